@@ -7,34 +7,266 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 
 #define IsNULL(ptr1, ptr2) ((ptr1 == NULL || ptr2 == NULL) ? (true) : (false))
+#define INDEX_INITIAL_CAPACITY 16
+#define SKIP_LIST_MAX_HEIGHT 16
+#define SKIP_LIST_SEED 0x9E3779B9u
+#define MERGE_PROBE_RATIO 16
+#define SLAB_CACHE_LINE 64
+#define SLAB_CHUNK_SIZE 16384
+#define SLAB_GRANULE 8
+#define SLAB_MAX_OBJECT 256
+#define SLAB_CLASSES (SLAB_MAX_OBJECT / SLAB_GRANULE)
+#define FLAT_INITIAL_CAPACITY 8
+#define FIXED_AMOUNT_LIMIT 9223372036854775808.0 // 2^63, past int64_t
+
+/** An amount is a double, or a scaled integer in a fixed point set */
+typedef union ASAmount_t {
+    double real;
+    int64_t fixed;
+} ASAmount;
 
 typedef struct ElementNode_t *ElementNode;
 struct ElementNode_t {
     ASElement element;
-    double amount;
+    ASAmount amount;
     ElementNode next_node;
+    int height;
+    bool in_block; // allocated inside one of the set's node blocks
+    ElementNode forward[]; // skip list links above next_node, height - 1 long
 };
 
+/** A slot of the open addressing hash index. An empty slot has a NULL node */
+typedef struct IndexSlot_t {
+    ElementNode node;
+    unsigned int hash;
+} IndexSlot;
+
+/*
+ * A set is either a chain of nodes (list and skip list backends) or a group
+ * of parallel sorted arrays (flat backend). Code which serves both works on
+ * positions: a position is an ElementNode in a node set, and a pointer into
+ * flat_elements in a flat set. Handles and iterators hold positions.
+ */
 struct AmountSet_t {
     ElementNode first_node;
-    ElementNode iterator;
+    void *iterator;
     int size;
     CopyASElement copyElement;
     FreeASElement freeElement;
     CompareASElements compareElements;
+    ASOptions options;
+    HashASElement hashElement;
+    IndexSlot *index;
+    int index_capacity;
+    int max_height;
+    int height;
+    unsigned int random_state;
+    ElementNode head_forward[SKIP_LIST_MAX_HEIGHT - 1];
+    void **node_blocks;
+    int node_blocks_count;
+    const ASAllocator *allocator;
+    void *allocator_context;
+    // flat backend: logical index i is at i, or at i + gap_length from
+    // gap_start on. Inserts and deletes move the gap to their position
+    ASElement *flat_elements;
+    int64_t *flat_keys; // only with a keyElement option
+    ASAmount *flat_amounts;
+    int flat_capacity;
+    int gap_start;
+    int gap_length;
 };
 
+/** A chunk of the slab allocator, at the start of its aligned memory */
+typedef struct SlabChunk_t {
+    struct SlabChunk_t *next;
+    void *raw; // pointer returned by malloc, before alignment
+} *SlabChunk;
+
+/** Nodes of one size: freed nodes are reused before the chunk is bumped */
+typedef struct SlabClass_t {
+    void *free_list;
+    char *bump;
+    char *bump_end;
+} SlabClass;
+
+typedef struct Slab_t {
+    SlabChunk chunks;
+    SlabClass classes[SLAB_CLASSES];
+} *Slab;
+
 static ElementNode
-createElementNode(AmountSet amount_set_ptr, ASElement element);
+createElementNode(AmountSet amount_set_ptr, ASElement element, int height,
+                  bool adopt);
+
+static ElementNode allocateNode(AmountSet set, int height);
+
+static ElementNode *nextLink(AmountSet set, ElementNode node, int level);
+
+static ElementNode findPredecessors(AmountSet set, ASElement element,
+                                    ElementNode *update);
+
+static int randomHeight(AmountSet set);
+
+static AmountSetResult registerElement(AmountSet set, ASElement element,
+                                       bool adopt, void **outPosition);
+
+static void deleteNode(AmountSet set, ElementNode to_delete,
+                       ElementNode *update);
+
+static ElementNode insertNode(AmountSet set, ASElement element, bool adopt,
+                              ElementNode *update);
+
+static ElementNode advancePredecessors(AmountSet set, ASElement element,
+                                       ElementNode *update);
+
+static void sortPositions(AmountSet set, ASElement *elements, int *order,
+                          int *scratch, int count);
+
+static AmountSetResult changeAmount(AmountSet set, ASAmount *amount,
+                                    double delta);
+
+static bool amountInRange(AmountSet set, double amount);
+
+static ASAmount makeAmount(AmountSet set, double amount);
+
+static double getAmount(AmountSet set, const ASAmount *amount);
+
+static AmountSetResult addAmount(AmountSet set, ASAmount *amount,
+                                 ASAmount delta, bool apply);
+
+static bool isFlat(AmountSet set);
+
+static void *findPosition(AmountSet set, ASElement element);
+
+static void *firstPosition(AmountSet set);
+
+static void *nextPosition(AmountSet set, void *position);
+
+static ASElement positionElement(AmountSet set, void *position);
+
+static ASAmount *positionAmount(AmountSet set, void *position);
+
+static int flatPhysical(AmountSet set, int logical);
+
+static int flatLogical(AmountSet set, void *position);
+
+static int flatLowerBound(AmountSet set, ASElement element);
+
+static bool flatMatches(AmountSet set, int logical, ASElement element);
+
+static void flatMove(AmountSet set, int to, int from, int count);
+
+static void flatMoveGap(AmountSet set, int logical);
+
+static bool flatResize(AmountSet set, int capacity);
+
+static AmountSetResult flatRegister(AmountSet set, ASElement element,
+                                    bool adopt, void **outPosition);
+
+static void flatDeleteAt(AmountSet set, int logical);
+
+static void flatClear(AmountSet set);
+
+static bool flatCopy(AmountSet set, AmountSet new_set);
+
+static AmountSetResult flatMergeBatch(AmountSet set, ASElement *elements,
+                                      const double *amounts, const int *order,
+                                      int count, AmountSetResult *results);
 
 static ElementNode findElement(AmountSet set, ASElement element);
 
+static size_t nodeSize(int height);
+
+static void freeNode(AmountSet set, ElementNode node);
+
+static void *addNodeBlock(AmountSet set, size_t block_size);
+
+static void freeNodeBlocks(AmountSet set);
+
+static bool indexReserve(AmountSet set, int needed_size);
+
+static void indexInsert(AmountSet set, ElementNode node);
+
+static ElementNode indexFind(AmountSet set, ASElement element);
+
+static void indexRemove(AmountSet set, ElementNode node);
+
+static void indexClear(AmountSet set);
+
+static void *slabCreate(void);
+
+static void slabDestroy(void *context);
+
+static void *slabAllocate(void *context, size_t size);
+
+static void slabDeallocate(void *context, void *ptr, size_t size);
+
+static const ASAllocator slab_allocator = {slabCreate, slabDestroy,
+                                           slabAllocate, slabDeallocate};
+
 AmountSet asCreate(CopyASElement copyElement,
                    FreeASElement freeElement,
                    CompareASElements compareElements) {
-    if (copyElement == NULL || freeElement == NULL || compareElements == NULL) {
+    ASOptions options = {AS_BACKEND_LIST, NULL};
+    return asCreateWithOptions(copyElement, freeElement, compareElements,
+                               &options);
+}
+
+AmountSet asCreateHashed(CopyASElement copyElement,
+                         FreeASElement freeElement,
+                         CompareASElements compareElements,
+                         HashASElement hashElement) {
+    if (hashElement == NULL) {
+        return NULL;
+    }
+    ASOptions options = {AS_BACKEND_LIST, hashElement};
+    return asCreateWithOptions(copyElement, freeElement, compareElements,
+                               &options);
+}
+
+AmountSet asCreateOrdered(CopyASElement copyElement,
+                          FreeASElement freeElement,
+                          CompareASElements compareElements) {
+    ASOptions options = {AS_BACKEND_SKIP_LIST, NULL};
+    return asCreateWithOptions(copyElement, freeElement, compareElements,
+                               &options);
+}
+
+AmountSet asCreateWithAllocator(CopyASElement copyElement,
+                                FreeASElement freeElement,
+                                CompareASElements compareElements,
+                                const ASAllocator *allocator) {
+    if (allocator == NULL) {
+        return NULL;
+    }
+    ASOptions options = {AS_BACKEND_LIST, NULL, allocator};
+    return asCreateWithOptions(copyElement, freeElement, compareElements,
+                               &options);
+}
+
+const ASAllocator *asSlabAllocator(void) {
+    return &slab_allocator;
+}
+
+AmountSet asCreateWithOptions(CopyASElement copyElement,
+                              FreeASElement freeElement,
+                              CompareASElements compareElements,
+                              const ASOptions *options) {
+    if (copyElement == NULL || freeElement == NULL || compareElements == NULL
+        || options == NULL || options->amountScale < 0) {
+        return NULL;
+    }
+    // only integer amounts can be swapped atomically
+    if (options->atomicAmounts && options->amountScale == 0) {
+        return NULL;
+    }
+    // a flat set keeps no nodes, so it has nothing to hash or to allocate
+    if (options->backend == AS_BACKEND_FLAT &&
+        (options->hashElement != NULL || options->allocator != NULL)) {
         return NULL;
     }
 
@@ -49,6 +281,46 @@ AmountSet asCreate(CopyASElement copyElement,
     as_ptr->freeElement = freeElement;
     as_ptr->compareElements = compareElements;
     as_ptr->first_node = NULL;
+    as_ptr->options = *options;
+    as_ptr->hashElement = options->hashElement;
+    as_ptr->index = NULL;
+    as_ptr->index_capacity = 0;
+    as_ptr->max_height = (options->backend == AS_BACKEND_SKIP_LIST)
+                         ? SKIP_LIST_MAX_HEIGHT : 1;
+    as_ptr->height = 1;
+    as_ptr->random_state = SKIP_LIST_SEED;
+    for (int i = 0; i < SKIP_LIST_MAX_HEIGHT - 1; i++) {
+        as_ptr->head_forward[i] = NULL;
+    }
+    as_ptr->node_blocks = NULL;
+    as_ptr->node_blocks_count = 0;
+    as_ptr->allocator = options->allocator;
+    as_ptr->allocator_context = NULL;
+    as_ptr->flat_elements = NULL;
+    as_ptr->flat_keys = NULL;
+    as_ptr->flat_amounts = NULL;
+    as_ptr->flat_capacity = 0;
+    as_ptr->gap_start = 0;
+    as_ptr->gap_length = 0;
+    if (as_ptr->allocator != NULL) {
+        if (as_ptr->allocator->allocate == NULL ||
+            as_ptr->allocator->deallocate == NULL) {
+            free(as_ptr);
+            return NULL;
+        }
+        if (as_ptr->allocator->createContext != NULL) {
+            as_ptr->allocator_context = as_ptr->allocator->createContext();
+            if (as_ptr->allocator_context == NULL) {
+                free(as_ptr);
+                return NULL;
+            }
+        }
+    }
+    if (!indexReserve(as_ptr, INDEX_INITIAL_CAPACITY / 2) ||
+        (isFlat(as_ptr) && !flatResize(as_ptr, FLAT_INITIAL_CAPACITY))) {
+        asDestroy(as_ptr);
+        return NULL;
+    }
     return as_ptr;
 }
 
@@ -56,42 +328,21 @@ AmountSetResult asDelete(AmountSet set, ASElement element) {
     if (IsNULL(set, element)) {
         return AS_NULL_ARGUMENT;
     }
-    if (!asContains(set, element)) {
-        return AS_ITEM_DOES_NOT_EXIST;
-    }
-    ElementNode ptr = set->first_node;
-    assert(ptr != NULL);
-    if (set->compareElements(element, ptr->element) ==
-        0) { //deleting the first element
-        set->first_node = set->first_node->next_node;
-        set->freeElement(ptr->element);
-        free(ptr);
-        set->size--;
-        set->iterator = NULL;
+    if (isFlat(set)) {
+        int logical = flatLowerBound(set, element);
+        if (!flatMatches(set, logical, element)) {
+            return AS_ITEM_DOES_NOT_EXIST;
+        }
+        flatDeleteAt(set, logical);
         return AS_SUCCESS;
     }
-    while (ptr->next_node != NULL) {
-        if (ptr->next_node->next_node == NULL) { //deleting the last element
-            assert(set->compareElements(element, ptr->next_node->element) == 0);
-            set->freeElement(ptr->next_node->element);
-            free(ptr->next_node);
-            ptr->next_node = NULL;
-            set->size--;
-            set->iterator = NULL;
-            return AS_SUCCESS;
-        }
-        if (set->compareElements(ptr->next_node->element, element) ==
-            0) { //deleting an element in the middle
-            ElementNode to_delete = ptr->next_node;
-            ptr->next_node = ptr->next_node->next_node;
-            set->freeElement(to_delete->element);
-            free(to_delete);
-            set->size--;
-            set->iterator = NULL;
-            return AS_SUCCESS;
-        }
-        ptr = ptr->next_node; //moving to the next node
+    ElementNode update[SKIP_LIST_MAX_HEIGHT];
+    ElementNode to_delete = findPredecessors(set, element, update);
+    if (to_delete == NULL ||
+        set->compareElements(to_delete->element, element) != 0) {
+        return AS_ITEM_DOES_NOT_EXIST;
     }
+    deleteNode(set, to_delete, update);
     return AS_SUCCESS;
 }
 
@@ -99,7 +350,8 @@ AmountSetResult asClear(AmountSet set) {
     if (set == NULL) {
         return AS_NULL_ARGUMENT;
     }
-    if (set->first_node == NULL) {
+    if (isFlat(set)) {
+        flatClear(set);
         return AS_SUCCESS;
     }
     ElementNode ptr = set->first_node;
@@ -108,11 +360,17 @@ AmountSetResult asClear(AmountSet set) {
         ElementNode to_delete = ptr;
         ptr = ptr->next_node;
         set->freeElement(to_delete->element);
-        free(to_delete);
+        freeNode(set, to_delete);
         set->size--;
     }
+    freeNodeBlocks(set);
     //   asDelete(set,ptr);     //deleting the last node
     set->first_node = NULL;
+    for (int i = 0; i < SKIP_LIST_MAX_HEIGHT - 1; i++) {
+        set->head_forward[i] = NULL;
+    }
+    set->height = 1;
+    indexClear(set);
     return AS_SUCCESS;
 }
 
@@ -120,7 +378,21 @@ void asDestroy(AmountSet set) {
     if (set == NULL) {
         return;
     }
-    asClear(set); //clear all elements from the set
+    if (set->allocator != NULL && set->allocator->destroyContext != NULL) {
+        // the context releases all nodes at once
+        for (ElementNode ptr = set->first_node; ptr != NULL;
+             ptr = ptr->next_node) {
+            set->freeElement(ptr->element);
+        }
+        set->allocator->destroyContext(set->allocator_context);
+        freeNodeBlocks(set);
+    } else {
+        asClear(set); //clear all elements from the set
+    }
+    free(set->index);
+    free(set->flat_elements);
+    free(set->flat_keys);
+    free(set->flat_amounts);
     free(set);
 }
 
@@ -128,27 +400,74 @@ AmountSet asCopy(AmountSet set) {
     if (set == NULL) {
         return NULL;
     }
-    AmountSet new_set = asCreate(set->copyElement, set->freeElement,
-                                 set->compareElements);
+    AmountSet new_set = asCreateWithOptions(set->copyElement,
+                                            set->freeElement,
+                                            set->compareElements,
+                                            &set->options);
     if (new_set == NULL) {
         return NULL;
     }
-    ElementNode ptr = set->first_node;
-    while (ptr != NULL) {
-        if (asRegister(new_set, ptr->element) != AS_SUCCESS) {
+    if (set->size == 0) {
+        return new_set;
+    }
+    if (isFlat(set)) {
+        if (!flatCopy(set, new_set)) {
             asDestroy(new_set);
             return NULL;
         }
-        ElementNode ptr_to_last = new_set->first_node;
-        while (ptr_to_last->next_node != NULL) {
-            ptr_to_last = ptr_to_last->next_node;
+        return new_set;
+    }
+    // the source is already sorted, so the copy is built in one pass. Unless
+    // the set has its own allocator all of its nodes share a single block
+    char *block = NULL;
+    if (new_set->allocator == NULL) {
+        size_t block_size = 0;
+        for (ElementNode ptr = set->first_node; ptr != NULL;
+             ptr = ptr->next_node) {
+            block_size += nodeSize(ptr->height);
+        }
+        block = addNodeBlock(new_set, block_size);
+        if (block == NULL) {
+            asDestroy(new_set);
+            return NULL;
         }
-        /*  ElementNode ptr_to_current = findElement(new_set,ptr->element);*/
-        asChangeAmount(new_set, ptr_to_last->element, ptr->amount);
-        ptr = ptr->next_node;
     }
-    //should we change the iterator of the original set if new set failed?
-    set->iterator = NULL;
+    if (!indexReserve(new_set, set->size)) {
+        asDestroy(new_set);
+        return NULL;
+    }
+    ElementNode last[SKIP_LIST_MAX_HEIGHT] = {NULL};
+    for (ElementNode ptr = set->first_node; ptr != NULL; ptr = ptr->next_node) {
+        ElementNode new_node;
+        if (block != NULL) {
+            new_node = (ElementNode) block;
+            block += nodeSize(ptr->height);
+            new_node->in_block = true;
+        } else {
+            new_node = allocateNode(new_set, ptr->height);
+            if (new_node == NULL) {
+                asDestroy(new_set);
+                return NULL;
+            }
+        }
+        new_node->height = ptr->height;
+        new_node->element = set->copyElement(ptr->element);
+        if (new_node->element == NULL) {
+            freeNode(new_set, new_node);
+            asDestroy(new_set);
+            return NULL;
+        }
+        new_node->amount = ptr->amount; // same options, same representation
+        for (int level = 0; level < new_node->height; level++) {
+            *nextLink(new_set, new_node, level) = NULL;
+            *nextLink(new_set, last[level], level) = new_node;
+            last[level] = new_node;
+        }
+        indexInsert(new_set, new_node);
+        new_set->size++;
+    }
+    new_set->height = set->height;
+    new_set->random_state = set->random_state;
     new_set->iterator = NULL;
     return new_set;
 }
@@ -164,7 +483,7 @@ bool asContains(AmountSet set, ASElement element) {
     if (IsNULL(set, element)) {
         return false;
     }
-    if (findElement(set, element) == NULL) {
+    if (findPosition(set, element) == NULL) {
         return false;
     }
     return true;
@@ -179,11 +498,11 @@ asGetAmount(AmountSet set, ASElement element, double *outAmount) {
     if (outAmount == NULL) {
         return AS_NULL_ARGUMENT;
     }
-    ElementNode ptr = findElement(set, element);
-    if (ptr == NULL) {
+    void *position = findPosition(set, element);
+    if (position == NULL) {
         return AS_ITEM_DOES_NOT_EXIST;
     }
-    *outAmount = ptr->amount;
+    *outAmount = getAmount(set, positionAmount(set, position));
     return AS_SUCCESS;
 }
 
@@ -191,91 +510,628 @@ AmountSetResult asRegister(AmountSet set, ASElement element) { // new version
     if (IsNULL(set, element)) {
         return AS_NULL_ARGUMENT;
     }
-    if (asContains(set, element)) {
-        return AS_ITEM_ALREADY_EXISTS;
+    void *position = NULL;
+    return registerElement(set, element, false, &position);
+}
+
+AmountSetResult
+asChangeAmount(AmountSet set, ASElement element, const double amount) {
+    if (IsNULL(set, element)) {
+        return AS_NULL_ARGUMENT;
     }
-    ElementNode new_node = createElementNode(set, element);
-    if (new_node == NULL) {
+    void *position = findPosition(set, element);
+    if (position == NULL) {
+        return AS_ITEM_DOES_NOT_EXIST;
+    }
+    return changeAmount(set, positionAmount(set, position), amount);
+}
+
+AmountSetResult asRegisterBatch(AmountSet set, ASElement *elements,
+                                const double *amounts, int count,
+                                AmountSetResult *results) {
+    if (IsNULL(set, elements) || count < 0) {
+        return AS_NULL_ARGUMENT;
+    }
+    int *order = malloc(sizeof(*order) * (count + 1));
+    if (order == NULL || !indexReserve(set, set->size + count)) {
+        free(order);
         return AS_OUT_OF_MEMORY;
     }
-    ElementNode ptr = set->first_node;
-    ElementNode previous = NULL;
-    if (ptr == NULL) { // adding element to an empty set
-        set->first_node = new_node;
-        new_node->next_node = NULL;
-        (set->size)++;
-        set->iterator = NULL;
-        return AS_SUCCESS;
+    // NULL elements are reported and left out, the rest is sorted if needed
+    int valid = 0;
+    bool sorted = true;
+    for (int i = 0; i < count; i++) {
+        if (elements[i] == NULL) {
+            if (results != NULL) {
+                results[i] = AS_NULL_ARGUMENT;
+            }
+            continue;
+        }
+        if (valid > 0 && set->compareElements(elements[order[valid - 1]],
+                                              elements[i]) > 0) {
+            sorted = false;
+        }
+        order[valid++] = i;
     }
-    while ((ptr != NULL) && (set->compareElements(element, ptr->element) >
-                             0)) { // adding element to an existing set
-        previous = ptr;
-        ptr = ptr->next_node;
+    if (!sorted) {
+        int *scratch = malloc(sizeof(*scratch) * valid);
+        if (scratch == NULL) {
+            free(order);
+            return AS_OUT_OF_MEMORY;
+        }
+        sortPositions(set, elements, order, scratch, valid);
+        free(scratch);
+    }
+    if (isFlat(set)) {
+        AmountSetResult result = flatMergeBatch(set, elements, amounts, order,
+                                                valid, results);
+        free(order);
+        return result;
     }
-    if (ptr == NULL) { //adding element to the end of the list
-        previous->next_node = new_node;
-        new_node->next_node = NULL;
-        set->size++;
-        set->iterator = NULL;
+    // a single merge of the sorted batch into the set
+    ElementNode update[SKIP_LIST_MAX_HEIGHT] = {NULL};
+    for (int i = 0; i < valid; i++) {
+        int position = order[i];
+        AmountSetResult result = AS_SUCCESS;
+        ElementNode successor = advancePredecessors(set, elements[position],
+                                                    update);
+        ElementNode previous = update[0]; // the last node added, on duplicates
+        if ((successor != NULL && set->compareElements(
+                successor->element, elements[position]) == 0) ||
+            (previous != NULL && set->compareElements(
+                    previous->element, elements[position]) == 0)) {
+            result = AS_ITEM_ALREADY_EXISTS;
+        } else if (amounts != NULL && amounts[position] < 0) {
+            result = AS_INSUFFICIENT_AMOUNT;
+        } else if (amounts != NULL && !amountInRange(set, amounts[position])) {
+            result = AS_INVALID_AMOUNT;
+        } else {
+            ElementNode new_node = insertNode(set, elements[position], false,
+                                              update);
+            if (new_node == NULL) {
+                result = AS_OUT_OF_MEMORY;
+            } else if (amounts != NULL) {
+                new_node->amount = makeAmount(set, amounts[position]);
+            }
+        }
+        if (results != NULL) {
+            results[position] = result;
+        }
+    }
+    free(order);
+    return AS_SUCCESS;
+}
+
+AmountSetResult asMergeApply(AmountSet destination, AmountSet source,
+                             int sign, bool checkOnly) {
+    if (IsNULL(destination, source)) {
+        return AS_NULL_ARGUMENT;
+    }
+    double factor = (sign < 0) ? -1 : 1;
+    // a small source is matched through the destination's index instead
+    bool probe = (destination->index != NULL || isFlat(destination)) &&
+                 source->size * MERGE_PROBE_RATIO < destination->size;
+    for (int pass = 0; pass < (checkOnly ? 1 : 2); pass++) {
+        void *match = firstPosition(destination);
+        for (void *position = firstPosition(source); position != NULL;
+             position = nextPosition(source, position)) {
+            ASElement element = positionElement(source, position);
+            ASAmount *amount = positionAmount(source, position);
+            if (probe) {
+                match = findPosition(destination, element);
+            } else {
+                while (match != NULL && destination->compareElements(
+                        positionElement(destination, match), element) < 0) {
+                    match = nextPosition(destination, match);
+                }
+                if (match != NULL && destination->compareElements(
+                        positionElement(destination, match), element) != 0) {
+                    match = NULL;
+                }
+            }
+            if (match == NULL) {
+                assert(pass == 0);
+                return AS_ITEM_DOES_NOT_EXIST;
+            }
+            ASAmount delta;
+            if (destination->options.amountScale != 0 &&
+                destination->options.amountScale ==
+                source->options.amountScale) { // exact, no conversion
+                delta.fixed = (sign < 0) ? -amount->fixed : amount->fixed;
+            } else if (amountInRange(destination, getAmount(source, amount))) {
+                delta = makeAmount(destination,
+                                   factor * getAmount(source, amount));
+            } else {
+                assert(pass == 0);
+                return AS_INVALID_AMOUNT;
+            }
+            // the second pass is already validated and can't fail
+            AmountSetResult result = addAmount(destination,
+                                               positionAmount(destination,
+                                                              match),
+                                               delta, pass == 1);
+            if (result != AS_SUCCESS) {
+                assert(pass == 0);
+                return result;
+            }
+        }
+    }
+    return AS_SUCCESS;
+}
+
+AmountSetResult asSumAmounts(AmountSet set, double *outSum) {
+    if (IsNULL(set, outSum)) {
+        return AS_NULL_ARGUMENT;
+    }
+    if (isFlat(set)) { // the amounts are contiguous, on both sides of the gap
+        int64_t fixed_sum = 0;
+        double sum = 0;
+        int ranges[2][2] = {{0, set->gap_start},
+                            {set->gap_start + set->gap_length,
+                             set->flat_capacity}};
+        for (int range = 0; range < 2; range++) {
+            const ASAmount *amounts = set->flat_amounts;
+            if (set->options.amountScale != 0) {
+                for (int i = ranges[range][0]; i < ranges[range][1]; i++) {
+                    fixed_sum += amounts[i].fixed;
+                }
+            } else {
+                for (int i = ranges[range][0]; i < ranges[range][1]; i++) {
+                    sum += amounts[i].real;
+                }
+            }
+        }
+        *outSum = (set->options.amountScale != 0)
+                  ? (double) fixed_sum / (double) set->options.amountScale
+                  : sum;
         return AS_SUCCESS;
     }
-    if (previous != NULL) { // adding element in the middle of the list
-        previous->next_node = new_node;
-        new_node->next_node = ptr;
-    } else { // adding element to the list's head
-        new_node->next_node = set->first_node;
-        set->first_node = new_node;
+    if (set->options.amountScale != 0) {
+        int64_t sum = 0;
+        for (ElementNode ptr = set->first_node; ptr != NULL;
+             ptr = ptr->next_node) {
+            sum += ptr->amount.fixed;
+        }
+        *outSum = (double) sum / (double) set->options.amountScale;
+        return AS_SUCCESS;
     }
-    set->size++;
-    set->iterator = NULL;
+    double sum = 0;
+    for (ElementNode ptr = set->first_node; ptr != NULL; ptr = ptr->next_node) {
+        sum += ptr->amount.real;
+    }
+    *outSum = sum;
     return AS_SUCCESS;
 }
 
-AmountSetResult
-asChangeAmount(AmountSet set, ASElement element, const double amount) {
+AmountSetResult asRegisterOwned(AmountSet set, ASElement element,
+                                ASHandle *outHandle) {
     if (IsNULL(set, element)) {
         return AS_NULL_ARGUMENT;
     }
-    ElementNode ptr = findElement(set, element);
-    if (ptr == NULL) {
-        return AS_ITEM_DOES_NOT_EXIST;
+    void *position = NULL;
+    AmountSetResult result = registerElement(set, element, true, &position);
+    if (result == AS_SUCCESS && outHandle != NULL) {
+        *outHandle = (ASHandle) position;
     }
-    if (ptr->amount + amount < 0) {
-        return AS_INSUFFICIENT_AMOUNT;
+    return result;
+}
+
+ASHandle asFind(AmountSet set, ASElement element) {
+    if (IsNULL(set, element)) {
+        return NULL;
+    }
+    return (ASHandle) findPosition(set, element);
+}
+
+AmountSetResult asFindOrRegister(AmountSet set, ASElement element,
+                                 ASHandle *outHandle) {
+    if (IsNULL(set, element) || outHandle == NULL) {
+        return AS_NULL_ARGUMENT;
+    }
+    void *position = (set->index != NULL) ? indexFind(set, element) : NULL;
+    if (position != NULL) {
+        *outHandle = (ASHandle) position;
+        return AS_ITEM_ALREADY_EXISTS;
+    }
+    AmountSetResult result = registerElement(set, element, false, &position);
+    if (position != NULL) {
+        *outHandle = (ASHandle) position;
+    }
+    return result;
+}
+
+ASElement asHandleGetElement(AmountSet set, ASHandle handle) {
+    if (IsNULL(set, handle)) {
+        return NULL;
+    }
+    return positionElement(set, handle);
+}
+
+AmountSetResult
+asHandleGetAmount(AmountSet set, ASHandle handle, double *outAmount) {
+    if (IsNULL(set, handle) || outAmount == NULL) {
+        return AS_NULL_ARGUMENT;
+    }
+    *outAmount = getAmount(set, positionAmount(set, handle));
+    return AS_SUCCESS;
+}
+
+AmountSetResult
+asHandleChangeAmount(AmountSet set, ASHandle handle, const double amount) {
+    if (IsNULL(set, handle)) {
+        return AS_NULL_ARGUMENT;
     }
-    ptr->amount += amount;
+    return changeAmount(set, positionAmount(set, handle), amount);
+}
+
+AmountSetResult asHandleDelete(AmountSet set, ASHandle handle) {
+    if (IsNULL(set, handle)) {
+        return AS_NULL_ARGUMENT;
+    }
+    if (isFlat(set)) {
+        flatDeleteAt(set, flatLogical(set, handle));
+        return AS_SUCCESS;
+    }
+    ElementNode to_delete = (ElementNode) handle;
+    ElementNode update[SKIP_LIST_MAX_HEIGHT];
+    ElementNode found = findPredecessors(set, to_delete->element, update);
+    assert(found == to_delete);
+    (void) found;
+    deleteNode(set, to_delete, update);
     return AS_SUCCESS;
 }
 
 
+ASElement asIterBegin(AmountSet set, ASIterator *iterator) {
+    if (IsNULL(set, iterator)) {
+        return NULL;
+    }
+    iterator->set = set;
+    iterator->position = firstPosition(set);
+    if (iterator->position == NULL) {
+        return NULL;
+    }
+    return positionElement(set, iterator->position);
+}
+
+ASElement asIterNext(ASIterator *iterator) {
+    if (iterator == NULL || iterator->position == NULL) {
+        return NULL;
+    }
+    iterator->position = nextPosition(iterator->set, iterator->position);
+    if (iterator->position == NULL) {
+        return NULL;
+    }
+    return positionElement(iterator->set, iterator->position);
+}
+
+ASElement asIterElement(const ASIterator *iterator) {
+    if (iterator == NULL || iterator->position == NULL) {
+        return NULL;
+    }
+    return positionElement(iterator->set, iterator->position);
+}
+
+double asIterAmount(const ASIterator *iterator) {
+    if (iterator == NULL || iterator->position == NULL) {
+        return 0;
+    }
+    return getAmount(iterator->set,
+                     positionAmount(iterator->set, iterator->position));
+}
+
+ASHandle asIterHandle(const ASIterator *iterator) {
+    if (iterator == NULL) {
+        return NULL;
+    }
+    return iterator->position;
+}
+
 ASElement asGetFirst(AmountSet set) {
-    if (IsNULL(set, set->first_node)) {
+    if (set == NULL) {
+        return NULL;
+    }
+    set->iterator = firstPosition(set);
+    if (set->iterator == NULL) {
         return NULL;
     }
-    set->iterator = set->first_node;
-    return set->first_node->element;
+    return positionElement(set, set->iterator);
 
 
 }
 
 ASElement asGetNext(AmountSet set) {
-    if (IsNULL(set, set->iterator)) {
+    if (set == NULL || set->iterator == NULL) {
+        return NULL;
+    }
+    void *next = nextPosition(set, set->iterator);
+    if (next == NULL) {// iterator points on the last element
+        return NULL;
+    }
+    set->iterator = next;
+    return positionElement(set, set->iterator);
+}
+
+
+/*
+ * Registers element unless an equal element is already in the set. On success
+ * and when the element already exists outPosition is set to its position. If
+ * adopt is true the set stores element itself instead of a copy.
+ */
+static AmountSetResult registerElement(AmountSet set, ASElement element,
+                                       bool adopt, void **outPosition) {
+    if (isFlat(set)) {
+        return flatRegister(set, element, adopt, outPosition);
+    }
+    ElementNode update[SKIP_LIST_MAX_HEIGHT];
+    ElementNode successor = findPredecessors(set, element, update);
+    if (successor != NULL &&
+        set->compareElements(successor->element, element) == 0) {
+        *outPosition = successor;
+        return AS_ITEM_ALREADY_EXISTS;
+    }
+    if (!indexReserve(set, set->size + 1)) {
+        return AS_OUT_OF_MEMORY;
+    }
+    ElementNode new_node = insertNode(set, element, adopt, update);
+    if (new_node == NULL) {
+        return AS_OUT_OF_MEMORY;
+    }
+    *outPosition = new_node;
+    return AS_SUCCESS;
+}
+
+/*
+ * Creates a node for element and links it after the predecessors in update,
+ * which then point at the new node on every level it takes part in. The index
+ * must have room for the node.
+ */
+static ElementNode insertNode(AmountSet set, ASElement element, bool adopt,
+                              ElementNode *update) {
+    int height = randomHeight(set);
+    ElementNode new_node = createElementNode(set, element, height, adopt);
+    if (new_node == NULL) {
+        return NULL;
+    }
+    while (set->height < height) { // new levels start at the head
+        update[set->height] = NULL;
+        set->height++;
+    }
+    for (int level = 0; level < height; level++) {
+        ElementNode *link = nextLink(set, update[level], level);
+        *nextLink(set, new_node, level) = *link;
+        *link = new_node;
+        update[level] = new_node;
+    }
+    indexInsert(set, new_node);
+    set->size++;
+    set->iterator = NULL;
+    return new_node;
+}
+
+/*
+ * Moves the predecessors in update forward to the last nodes before element.
+ * Used when elements are visited in ascending order, so every level of the
+ * set is walked at most once in total.
+ */
+static ElementNode advancePredecessors(AmountSet set, ASElement element,
+                                       ElementNode *update) {
+    for (int level = set->height - 1; level >= 0; level--) {
+        ElementNode node = update[level];
+        ElementNode next = *nextLink(set, node, level);
+        while (next != NULL && set->compareElements(next->element, element) < 0) {
+            node = next;
+            next = *nextLink(set, node, level);
+        }
+        update[level] = node;
+    }
+    return *nextLink(set, update[0], 0);
+}
+
+/* Stable merge sort of the positions in order by the elements they point to */
+static void sortPositions(AmountSet set, ASElement *elements, int *order,
+                          int *scratch, int count) {
+    if (count < 2) {
+        return;
+    }
+    int middle = count / 2;
+    sortPositions(set, elements, order, scratch, middle);
+    sortPositions(set, elements, order + middle, scratch, count - middle);
+    int left = 0, right = middle, out = 0;
+    while (left < middle && right < count) {
+        if (set->compareElements(elements[order[right]],
+                                 elements[order[left]]) < 0) {
+            scratch[out++] = order[right++];
+        } else {
+            scratch[out++] = order[left++];
+        }
+    }
+    while (left < middle) {
+        scratch[out++] = order[left++];
+    }
+    while (right < count) {
+        scratch[out++] = order[right++];
+    }
+    for (int i = 0; i < count; i++) {
+        order[i] = scratch[i];
+    }
+}
+
+/* Unlinks and frees to_delete, given its predecessors from findPredecessors */
+static void deleteNode(AmountSet set, ElementNode to_delete,
+                       ElementNode *update) {
+    for (int level = 0; level < to_delete->height; level++) {
+        *nextLink(set, update[level], level) =
+                *nextLink(set, to_delete, level);
+    }
+    while (set->height > 1 &&
+           set->head_forward[set->height - 2] == NULL) { // shrink empty levels
+        set->height--;
+    }
+    indexRemove(set, to_delete);
+    set->freeElement(to_delete->element);
+    freeNode(set, to_delete);
+    set->size--;
+    set->iterator = NULL;
+}
+
+static AmountSetResult changeAmount(AmountSet set, ASAmount *amount,
+                                    double delta) {
+    if (!amountInRange(set, delta)) {
+        return AS_INVALID_AMOUNT;
+    }
+    return addAmount(set, amount, makeAmount(set, delta), true);
+}
+
+bool asAmountInRange(double amount, int64_t amountScale) {
+    if (amountScale == 0) {
+        return true;
+    }
+    double scaled = amount * (double) amountScale;
+    return scaled > -FIXED_AMOUNT_LIMIT && scaled < FIXED_AMOUNT_LIMIT;
+}
+
+/* Checks that amount has a representation in set: a fixed one must fit */
+static bool amountInRange(AmountSet set, double amount) {
+    return asAmountInRange(amount, set->options.amountScale);
+}
+
+/*
+ * Converts amount to the representation used by set, rounding to its scale.
+ * amount must be in range.
+ */
+static ASAmount makeAmount(AmountSet set, double amount) {
+    ASAmount result;
+    if (set->options.amountScale == 0) {
+        result.real = amount;
+        return result;
+    }
+    assert(amountInRange(set, amount));
+    double scaled = amount * (double) set->options.amountScale;
+    result.fixed = (int64_t) (scaled + ((scaled < 0) ? -0.5 : 0.5));
+    return result;
+}
+
+static double getAmount(AmountSet set, const ASAmount *amount) {
+    if (set->options.amountScale == 0) {
+        return amount->real;
+    }
+    int64_t fixed = set->options.atomicAmounts
+                    ? __atomic_load_n(&amount->fixed, __ATOMIC_RELAXED)
+                    : amount->fixed;
+    return (double) fixed / (double) set->options.amountScale;
+}
+
+/*
+ * Checks that adding delta keeps amount non negative, and in range for a fixed
+ * amount, and adds it if apply is true.
+ */
+static AmountSetResult addAmount(AmountSet set, ASAmount *amount,
+                                 ASAmount delta, bool apply) {
+    if (set->options.amountScale == 0) {
+        if (amount->real + delta.real < 0) {
+            return AS_INSUFFICIENT_AMOUNT;
+        }
+        if (apply) {
+            amount->real += delta.real;
+        }
+        return AS_SUCCESS;
+    }
+    if (set->options.atomicAmounts) {
+        // the check holds for the value swapped, or the swap is tried again
+        int64_t current = __atomic_load_n(&amount->fixed, __ATOMIC_RELAXED);
+        do {
+            if (delta.fixed > 0 && current > INT64_MAX - delta.fixed) {
+                return AS_INVALID_AMOUNT;
+            }
+            if (current + delta.fixed < 0) {
+                return AS_INSUFFICIENT_AMOUNT;
+            }
+            if (!apply) {
+                return AS_SUCCESS;
+            }
+        } while (!__atomic_compare_exchange_n(&amount->fixed, &current,
+                                              current + delta.fixed, true,
+                                              __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED));
+        return AS_SUCCESS;
+    }
+    if (delta.fixed > 0 && amount->fixed > INT64_MAX - delta.fixed) {
+        return AS_INVALID_AMOUNT;
+    }
+    if (amount->fixed + delta.fixed < 0) {
+        return AS_INSUFFICIENT_AMOUNT;
+    }
+    if (apply) {
+        amount->fixed += delta.fixed;
+    }
+    return AS_SUCCESS;
+}
+
+static bool isFlat(AmountSet set) {
+    return set->options.backend == AS_BACKEND_FLAT;
+}
+
+static void *findPosition(AmountSet set, ASElement element) {
+    if (!isFlat(set)) {
+        return findElement(set, element);
+    }
+    int logical = flatLowerBound(set, element);
+    if (!flatMatches(set, logical, element)) {
         return NULL;
     }
-    if (set->first_node == NULL) {
+    return &set->flat_elements[flatPhysical(set, logical)];
+}
+
+static void *firstPosition(AmountSet set) {
+    if (!isFlat(set)) {
+        return set->first_node;
+    }
+    if (set->size == 0) {
         return NULL;
     }
-    if (set->iterator->next_node ==
-        NULL) {// iterator points on the last element
+    return &set->flat_elements[flatPhysical(set, 0)];
+}
+
+static void *nextPosition(AmountSet set, void *position) {
+    if (!isFlat(set)) {
+        return ((ElementNode) position)->next_node;
+    }
+    int logical = flatLogical(set, position) + 1;
+    if (logical >= set->size) {
         return NULL;
     }
-    set->iterator = set->iterator->next_node;
-    return set->iterator->element;
+    return &set->flat_elements[flatPhysical(set, logical)];
 }
 
+static ASElement positionElement(AmountSet set, void *position) {
+    if (!isFlat(set)) {
+        return ((ElementNode) position)->element;
+    }
+    return *(ASElement *) position;
+}
+
+static ASAmount *positionAmount(AmountSet set, void *position) {
+    if (!isFlat(set)) {
+        return &((ElementNode) position)->amount;
+    }
+    return &set->flat_amounts[(ASElement *) position - set->flat_elements];
+}
 
 static ElementNode findElement(AmountSet set, ASElement element) {
     assert(set != NULL && element != NULL);
+    if (set->index != NULL) {
+        return indexFind(set, element);
+    }
+    if (set->max_height > 1) {
+        ElementNode update[SKIP_LIST_MAX_HEIGHT];
+        ElementNode candidate = findPredecessors(set, element, update);
+        if (candidate != NULL &&
+            set->compareElements(candidate->element, element) == 0) {
+            return candidate;
+        }
+        return NULL;
+    }
     ElementNode ptr = set->first_node;
     while (ptr != NULL) {
         if (ptr->element == NULL) {
@@ -291,8 +1147,9 @@ static ElementNode findElement(AmountSet set, ASElement element) {
 }
 
 static ElementNode
-createElementNode(AmountSet amount_set_ptr, ASElement element) {
-    ElementNode ptr = malloc(sizeof(*ptr));
+createElementNode(AmountSet amount_set_ptr, ASElement element, int height,
+                  bool adopt) {
+    ElementNode ptr = allocateNode(amount_set_ptr, height);
     if (ptr == NULL) {
         return NULL;
     }
@@ -300,11 +1157,552 @@ createElementNode(AmountSet amount_set_ptr, ASElement element) {
     if(ptr->element == NULL){
         return NULL;
     }*/
-    ptr->amount = 0;
+    ptr->amount = makeAmount(amount_set_ptr, 0);
     ptr->next_node = NULL;
-    ptr->element = amount_set_ptr->copyElement(element);
+    ptr->element = adopt ? element : amount_set_ptr->copyElement(element);
+    if (ptr->element == NULL) {
+        freeNode(amount_set_ptr, ptr);
+        return NULL;
+    }
     return ptr;
 }
 
+static ElementNode allocateNode(AmountSet set, int height) {
+    ElementNode node = (set->allocator == NULL)
+                       ? malloc(nodeSize(height))
+                       : set->allocator->allocate(set->allocator_context,
+                                                  nodeSize(height));
+    if (node == NULL) {
+        return NULL;
+    }
+    node->height = height;
+    node->in_block = false;
+    return node;
+}
+
+
+
+
+
+static size_t nodeSize(int height) {
+    return sizeof(struct ElementNode_t) + sizeof(ElementNode) * (height - 1);
+}
+
+/*
+ * Nodes created by asCopy share one block per copy. Such a node is not freed
+ * on its own - its memory is returned when the set is cleared or destroyed.
+ */
+static void freeNode(AmountSet set, ElementNode node) {
+    if (node->in_block) {
+        return;
+    }
+    if (set->allocator == NULL) {
+        free(node);
+        return;
+    }
+    set->allocator->deallocate(set->allocator_context, node,
+                               nodeSize(node->height));
+}
+
+static void *addNodeBlock(AmountSet set, size_t block_size) {
+    void **new_blocks = realloc(set->node_blocks, sizeof(*new_blocks) *
+                                                  (set->node_blocks_count + 1));
+    if (new_blocks == NULL) {
+        return NULL;
+    }
+    set->node_blocks = new_blocks;
+    void *block = malloc(block_size);
+    if (block == NULL) {
+        return NULL;
+    }
+    set->node_blocks[set->node_blocks_count++] = block;
+    return block;
+}
+
+static void freeNodeBlocks(AmountSet set) {
+    for (int i = 0; i < set->node_blocks_count; i++) {
+        free(set->node_blocks[i]);
+    }
+    free(set->node_blocks);
+    set->node_blocks = NULL;
+    set->node_blocks_count = 0;
+}
+
+/*
+ * A list set is a skip list whose nodes all have height 1, so the same
+ * search serves both backends. A NULL node stands for the head of the set.
+ */
+
+static ElementNode *nextLink(AmountSet set, ElementNode node, int level) {
+    if (node == NULL) {
+        return (level == 0) ? &set->first_node : &set->head_forward[level - 1];
+    }
+    assert(level < node->height);
+    return (level == 0) ? &node->next_node : &node->forward[level - 1];
+}
+
+/*
+ * Fills update with the last node before element on every level of the set
+ * and returns the first node which is not smaller than element, or NULL.
+ */
+static ElementNode findPredecessors(AmountSet set, ASElement element,
+                                    ElementNode *update) {
+    ElementNode node = NULL;
+    for (int level = set->height - 1; level >= 0; level--) {
+        ElementNode next = *nextLink(set, node, level);
+        while (next != NULL && set->compareElements(next->element, element) < 0) {
+            node = next;
+            next = *nextLink(set, node, level);
+        }
+        update[level] = node;
+    }
+    return *nextLink(set, node, 0);
+}
+
+static int randomHeight(AmountSet set) {
+    int height = 1;
+    // xorshift, each extra level is taken with probability 1/4
+    while (height < set->max_height) {
+        set->random_state ^= set->random_state << 13;
+        set->random_state ^= set->random_state >> 17;
+        set->random_state ^= set->random_state << 5;
+        if ((set->random_state & 3) != 0) {
+            break;
+        }
+        height++;
+    }
+    return height;
+}
+
+/*
+ * The hash index is an open addressing table with linear probing. Its
+ * capacity is a power of two and it is kept at most half full, so probe
+ * sequences stay short. Deletion shifts the following entries back instead of
+ * leaving tombstones.
+ */
+
+static bool indexReserve(AmountSet set, int needed_size) {
+    if (set->hashElement == NULL) {
+        return true;
+    }
+    if (needed_size * 2 <= set->index_capacity) {
+        return true;
+    }
+    int new_capacity = (set->index_capacity == 0) ? INDEX_INITIAL_CAPACITY
+                                                   : set->index_capacity;
+    while (needed_size * 2 > new_capacity) {
+        new_capacity *= 2;
+    }
+    IndexSlot *new_index = calloc(new_capacity, sizeof(*new_index));
+    if (new_index == NULL) {
+        return false;
+    }
+    IndexSlot *old_index = set->index;
+    int old_capacity = set->index_capacity;
+    set->index = new_index;
+    set->index_capacity = new_capacity;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_index[i].node == NULL) {
+            continue;
+        }
+        unsigned int position = old_index[i].hash & (new_capacity - 1);
+        while (new_index[position].node != NULL) {
+            position = (position + 1) & (new_capacity - 1);
+        }
+        new_index[position] = old_index[i];
+    }
+    free(old_index);
+    return true;
+}
+
+static void indexInsert(AmountSet set, ElementNode node) {
+    if (set->index == NULL) {
+        return;
+    }
+    unsigned int mask = set->index_capacity - 1;
+    unsigned int hash = set->hashElement(node->element);
+    unsigned int position = hash & mask;
+    while (set->index[position].node != NULL) {
+        position = (position + 1) & mask;
+    }
+    set->index[position].node = node;
+    set->index[position].hash = hash;
+}
+
+static ElementNode indexFind(AmountSet set, ASElement element) {
+    assert(set->index != NULL);
+    unsigned int mask = set->index_capacity - 1;
+    unsigned int hash = set->hashElement(element);
+    unsigned int position = hash & mask;
+    while (set->index[position].node != NULL) {
+        if (set->index[position].hash == hash &&
+            set->compareElements(set->index[position].node->element,
+                                 element) == 0) {
+            return set->index[position].node;
+        }
+        position = (position + 1) & mask;
+    }
+    return NULL;
+}
+
+static void indexRemove(AmountSet set, ElementNode node) {
+    if (set->index == NULL) {
+        return;
+    }
+    unsigned int mask = set->index_capacity - 1;
+    unsigned int position = set->hashElement(node->element) & mask;
+    while (set->index[position].node != node) {
+        assert(set->index[position].node != NULL);
+        position = (position + 1) & mask;
+    }
+    unsigned int hole = position;
+    position = (position + 1) & mask;
+    while (set->index[position].node != NULL) {
+        unsigned int home = set->index[position].hash & mask;
+        // move the entry back if the hole lies between its home and its slot
+        if (((position - home) & mask) >= ((position - hole) & mask)) {
+            set->index[hole] = set->index[position];
+            hole = position;
+        }
+        position = (position + 1) & mask;
+    }
+    set->index[hole].node = NULL;
+}
+
+static void indexClear(AmountSet set) {
+    for (int i = 0; i < set->index_capacity; i++) {
+        set->index[i].node = NULL;
+    }
+}
+
+/*
+ * The flat backend keeps elements, keys and amounts in parallel arrays sorted
+ * by element, so lookups are a binary search over contiguous memory. The free
+ * slots of the arrays form a single gap; an insert or a delete first moves
+ * the gap to its position, so a run of nearby changes moves little memory.
+ */
+
+static int flatPhysical(AmountSet set, int logical) {
+    return (logical < set->gap_start) ? logical : logical + set->gap_length;
+}
+
+static int flatLogical(AmountSet set, void *position) {
+    int physical = (int) ((ASElement *) position - set->flat_elements);
+    assert(physical >= 0 && physical < set->flat_capacity);
+    return (physical < set->gap_start) ? physical : physical - set->gap_length;
+}
+
+/* Returns the logical index of the first element not smaller than element */
+static int flatLowerBound(AmountSet set, ASElement element) {
+    int low = 0, high = set->size;
+    if (set->flat_keys != NULL) { // compares keys without calling back
+        int64_t key = set->options.keyElement(element);
+        while (low < high) {
+            int middle = low + (high - low) / 2;
+            if (set->flat_keys[flatPhysical(set, middle)] < key) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return low;
+    }
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (set->compareElements(set->flat_elements[flatPhysical(set, middle)],
+                                 element) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static bool flatMatches(AmountSet set, int logical, ASElement element) {
+    if (logical >= set->size) {
+        return false;
+    }
+    int physical = flatPhysical(set, logical);
+    if (set->flat_keys != NULL) {
+        return set->flat_keys[physical] == set->options.keyElement(element);
+    }
+    return set->compareElements(set->flat_elements[physical], element) == 0;
+}
+
+static void flatMove(AmountSet set, int to, int from, int count) {
+    memmove(set->flat_elements + to, set->flat_elements + from,
+            sizeof(*set->flat_elements) * count);
+    memmove(set->flat_amounts + to, set->flat_amounts + from,
+            sizeof(*set->flat_amounts) * count);
+    if (set->flat_keys != NULL) {
+        memmove(set->flat_keys + to, set->flat_keys + from,
+                sizeof(*set->flat_keys) * count);
+    }
+}
+
+static void flatMoveGap(AmountSet set, int logical) {
+    if (logical < set->gap_start) {
+        flatMove(set, logical + set->gap_length, logical,
+                 set->gap_start - logical);
+    } else if (logical > set->gap_start) {
+        flatMove(set, set->gap_start, set->gap_start + set->gap_length,
+                 logical - set->gap_start);
+    }
+    set->gap_start = logical;
+}
+
+/* Resizes the arrays to capacity, which leaves the gap at their end */
+static bool flatResize(AmountSet set, int capacity) {
+    assert(capacity >= set->size);
+    flatMoveGap(set, set->size);
+    ASElement *elements = realloc(set->flat_elements,
+                                  sizeof(*elements) * capacity);
+    if (elements == NULL) {
+        return false;
+    }
+    set->flat_elements = elements;
+    ASAmount *amounts = realloc(set->flat_amounts, sizeof(*amounts) * capacity);
+    if (amounts == NULL) {
+        return false;
+    }
+    set->flat_amounts = amounts;
+    if (set->options.keyElement != NULL) {
+        int64_t *keys = realloc(set->flat_keys, sizeof(*keys) * capacity);
+        if (keys == NULL) {
+            return false;
+        }
+        set->flat_keys = keys;
+    }
+    set->flat_capacity = capacity;
+    set->gap_length = capacity - set->size;
+    return true;
+}
+
+static AmountSetResult flatRegister(AmountSet set, ASElement element,
+                                    bool adopt, void **outPosition) {
+    int logical = flatLowerBound(set, element);
+    if (flatMatches(set, logical, element)) {
+        *outPosition = &set->flat_elements[flatPhysical(set, logical)];
+        return AS_ITEM_ALREADY_EXISTS;
+    }
+    if (set->gap_length == 0 && !flatResize(set, set->flat_capacity * 2)) {
+        return AS_OUT_OF_MEMORY;
+    }
+    ASElement new_element = adopt ? element : set->copyElement(element);
+    if (new_element == NULL) {
+        return AS_OUT_OF_MEMORY;
+    }
+    flatMoveGap(set, logical);
+    int physical = set->gap_start;
+    set->flat_elements[physical] = new_element;
+    set->flat_amounts[physical] = makeAmount(set, 0);
+    if (set->flat_keys != NULL) {
+        set->flat_keys[physical] = set->options.keyElement(new_element);
+    }
+    set->gap_start++;
+    set->gap_length--;
+    set->size++;
+    set->iterator = NULL;
+    *outPosition = &set->flat_elements[physical];
+    return AS_SUCCESS;
+}
 
+static void flatDeleteAt(AmountSet set, int logical) {
+    assert(logical >= 0 && logical < set->size);
+    flatMoveGap(set, logical);
+    set->freeElement(set->flat_elements[set->gap_start + set->gap_length]);
+    set->gap_length++;
+    set->size--;
+    set->iterator = NULL;
+}
+
+static void flatClear(AmountSet set) {
+    for (int i = 0; i < set->size; i++) {
+        set->freeElement(set->flat_elements[flatPhysical(set, i)]);
+    }
+    set->size = 0;
+    set->gap_start = 0;
+    set->gap_length = set->flat_capacity;
+    set->iterator = NULL;
+}
+
+/* Copies the elements of set into the empty new_set, closing the gap */
+static bool flatCopy(AmountSet set, AmountSet new_set) {
+    if (set->size > new_set->flat_capacity &&
+        !flatResize(new_set, set->size)) {
+        return false;
+    }
+    for (int i = 0; i < set->size; i++) {
+        int physical = flatPhysical(set, i);
+        ASElement new_element = set->copyElement(set->flat_elements[physical]);
+        if (new_element == NULL) {
+            return false;
+        }
+        new_set->flat_elements[i] = new_element;
+        new_set->flat_amounts[i] = set->flat_amounts[physical];
+        if (new_set->flat_keys != NULL) {
+            new_set->flat_keys[i] = set->flat_keys[physical];
+        }
+        new_set->gap_start++;
+        new_set->gap_length--;
+        new_set->size++;
+    }
+    return true;
+}
+
+/*
+ * Merges the batch, sorted through order, with the set into new arrays. The
+ * set is walked once, so a batch costs O(n + m) instead of one move per
+ * element.
+ */
+static AmountSetResult flatMergeBatch(AmountSet set, ASElement *elements,
+                                      const double *amounts, const int *order,
+                                      int count, AmountSetResult *results) {
+    int capacity = set->size + count;
+    if (capacity < FLAT_INITIAL_CAPACITY) {
+        capacity = FLAT_INITIAL_CAPACITY;
+    }
+    ASElement *new_elements = malloc(sizeof(*new_elements) * capacity);
+    ASAmount *new_amounts = malloc(sizeof(*new_amounts) * capacity);
+    int64_t *new_keys = (set->flat_keys != NULL)
+                        ? malloc(sizeof(*new_keys) * capacity) : NULL;
+    if (new_elements == NULL || new_amounts == NULL ||
+        (set->flat_keys != NULL && new_keys == NULL)) {
+        free(new_elements);
+        free(new_amounts);
+        free(new_keys);
+        return AS_OUT_OF_MEMORY;
+    }
+    int out = 0, existing = 0;
+    for (int i = 0; i <= count; i++) {
+        // first the existing elements which come before the next new one
+        while (existing < set->size &&
+               (i == count || set->compareElements(
+                       set->flat_elements[flatPhysical(set, existing)],
+                       elements[order[i]]) < 0)) {
+            int physical = flatPhysical(set, existing++);
+            new_elements[out] = set->flat_elements[physical];
+            new_amounts[out] = set->flat_amounts[physical];
+            if (new_keys != NULL) {
+                new_keys[out] = set->flat_keys[physical];
+            }
+            out++;
+        }
+        if (i == count) {
+            break;
+        }
+        int position = order[i];
+        AmountSetResult result = AS_SUCCESS;
+        if ((existing < set->size && flatMatches(set, existing,
+                                                 elements[position])) ||
+            (out > 0 && set->compareElements(new_elements[out - 1],
+                                             elements[position]) == 0)) {
+            result = AS_ITEM_ALREADY_EXISTS;
+        } else if (amounts != NULL && amounts[position] < 0) {
+            result = AS_INSUFFICIENT_AMOUNT;
+        } else if (amounts != NULL && !amountInRange(set, amounts[position])) {
+            result = AS_INVALID_AMOUNT;
+        } else {
+            new_elements[out] = set->copyElement(elements[position]);
+            if (new_elements[out] == NULL) {
+                result = AS_OUT_OF_MEMORY;
+            } else {
+                new_amounts[out] = makeAmount(set, (amounts != NULL)
+                                                   ? amounts[position] : 0);
+                if (new_keys != NULL) {
+                    new_keys[out] = set->options.keyElement(new_elements[out]);
+                }
+                out++;
+            }
+        }
+        if (results != NULL) {
+            results[position] = result;
+        }
+    }
+    free(set->flat_elements);
+    free(set->flat_amounts);
+    free(set->flat_keys);
+    set->flat_elements = new_elements;
+    set->flat_amounts = new_amounts;
+    set->flat_keys = new_keys;
+    set->flat_capacity = capacity;
+    set->size = out;
+    set->gap_start = out;
+    set->gap_length = capacity - out;
+    set->iterator = NULL;
+    return AS_SUCCESS;
+}
+
+/*
+ * The built in slab allocator keeps one free list and one bump region per
+ * size class. Chunks are aligned to the cache line and only released together
+ * when the set is destroyed.
+ */
+
+static void *slabCreate(void) {
+    Slab slab = malloc(sizeof(*slab));
+    if (slab == NULL) {
+        return NULL;
+    }
+    slab->chunks = NULL;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        slab->classes[i].free_list = NULL;
+        slab->classes[i].bump = NULL;
+        slab->classes[i].bump_end = NULL;
+    }
+    return slab;
+}
+
+static void slabDestroy(void *context) {
+    Slab slab = context;
+    SlabChunk chunk = slab->chunks;
+    while (chunk != NULL) {
+        SlabChunk next = chunk->next;
+        free(chunk->raw);
+        chunk = next;
+    }
+    free(slab);
+}
+
+static void *slabAllocate(void *context, size_t size) {
+    Slab slab = context;
+    if (size > SLAB_MAX_OBJECT) {
+        return NULL;
+    }
+    size = (size + SLAB_GRANULE - 1) / SLAB_GRANULE * SLAB_GRANULE;
+    SlabClass *size_class = &slab->classes[size / SLAB_GRANULE - 1];
+    if (size_class->free_list != NULL) {
+        void *object = size_class->free_list;
+        size_class->free_list = *(void **) object;
+        return object;
+    }
+    if (size_class->bump == NULL || size_class->bump + size >
+                                    size_class->bump_end) {
+        void *raw = malloc(SLAB_CHUNK_SIZE + SLAB_CACHE_LINE);
+        if (raw == NULL) {
+            return NULL;
+        }
+        uintptr_t aligned = ((uintptr_t) raw + SLAB_CACHE_LINE - 1) &
+                            ~(uintptr_t) (SLAB_CACHE_LINE - 1);
+        SlabChunk chunk = (SlabChunk) aligned;
+        chunk->raw = raw;
+        chunk->next = slab->chunks;
+        slab->chunks = chunk;
+        // the chunk header takes the first cache line
+        size_class->bump = (char *) aligned + SLAB_CACHE_LINE;
+        size_class->bump_end = (char *) aligned + SLAB_CHUNK_SIZE;
+    }
+    void *object = size_class->bump;
+    size_class->bump += size;
+    return object;
+}
 
+static void slabDeallocate(void *context, void *ptr, size_t size) {
+    Slab slab = context;
+    assert(size <= SLAB_MAX_OBJECT);
+    size = (size + SLAB_GRANULE - 1) / SLAB_GRANULE * SLAB_GRANULE;
+    SlabClass *size_class = &slab->classes[size / SLAB_GRANULE - 1];
+    *(void **) ptr = size_class->free_list;
+    size_class->free_list = ptr;
+}
\ No newline at end of file
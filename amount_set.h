@@ -3,6 +3,8 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * Generic Amount Set Container
@@ -16,20 +18,49 @@
  *
  * The following functions are available:
  * d  asCreate           - Creates a new empty set
+ *   asCreateHashed     - Creates a new empty set with a hash index for
+ *                        constant time lookups
+ *   asCreateOrdered    - Creates a new empty set backed by a skip list for
+ *                        logarithmic time register, delete and lookup
+ *   asCreateWithAllocator - Creates a new empty set whose nodes are allocated
+ *                        by the given allocator
+ *   asSlabAllocator    - Returns the built in slab allocator
+ *   asCreateWithOptions - Creates a new empty set with the given backend and
+ *                        options
+ *   asAmountInRange    - Checks that an amount can be kept at a given scale
  * d  asDestroy          - Deletes an existing set and frees all resources
  * d  asCopy             - Copies an existing set
  * d  asGetSize          - Returns the size of the set
  *   asContains         - Checks if an element exists in the set
  * d  asGetAmount         - Returns the amount of an element in the set
  * --memory  asRegister         - Add a new element into the set
+ *   asRegisterOwned    - Add an element into the set without copying it
+ *   asRegisterBatch    - Add many elements into the set in a single pass
+ *   asMergeApply       - Add or subtract the amounts of one set to or from
+ *                        another in a single merge
+ *   asSumAmounts       - Returns the sum of the amounts of all elements
  * d  asChangeAmount     - Increase or decrease the amount of an element in the set
  * e  asDelete           - Delete an element completely from the set
  * d  asClear            - Deletes all elements from target set
+ *   asFind             - Returns a handle to an element of the set
+ *   asFindOrRegister   - Returns a handle to an element, adding it to the set
+ *                        if it is not there yet
+ *   asHandleGetElement - Returns the element a handle refers to
+ *   asHandleGetAmount  - Returns the amount of the element a handle refers to
+ *   asHandleChangeAmount - Changes the amount of the element a handle refers to
+ *   asHandleDelete     - Deletes the element a handle refers to
  *   asGetFirst         - Sets the internal iterator to the first element
  *                        in the set, and returns it.
  *   asGetNext          - Advances the internal iterator to the next element
  *                        and returns it.
  *   AS_FOREACH         - A macro for iterating over the set's elements
+ *   asIterBegin        - Starts an external iteration over the set
+ *   asIterNext         - Advances an external iterator
+ *   asIterElement      - Returns the current element of an external iterator
+ *   asIterAmount       - Returns the current amount of an external iterator
+ *   asIterHandle       - Returns a handle to the current element of an
+ *                        external iterator
+ *   AS_FOREACH_ITER    - A macro for iterating with an external iterator
  */
 
 /** Type for defining the set */
@@ -42,9 +73,32 @@ typedef enum AmountSetResult_t {
     AS_NULL_ARGUMENT,
     AS_ITEM_ALREADY_EXISTS,
     AS_ITEM_DOES_NOT_EXIST,
-    AS_INSUFFICIENT_AMOUNT
+    AS_INSUFFICIENT_AMOUNT,
+    AS_INVALID_AMOUNT
 } AmountSetResult;
 
+/**
+ * Handle to an element inside a set. A handle lets a caller read, change or
+ * delete an element found once without searching the set again. It stays
+ * valid until the element it refers to is deleted from the set, and may only
+ * be used with the set it came from. In a set with the AS_BACKEND_FLAT backend
+ * a handle only stays valid while no element is registered to or deleted from
+ * the set.
+ */
+typedef struct ASHandle_t *ASHandle;
+
+/**
+ * External iterator over a set. Unlike the internal iterator it belongs to the
+ * caller, usually on the stack, and iterating never changes the set, so any
+ * number of iterations over the same set may run at the same time.
+ * An iterator stays valid while no element is registered to or deleted from
+ * the set. Its fields are private to the set implementation.
+ */
+typedef struct ASIterator_t {
+    AmountSet set;
+    void *position;
+} ASIterator;
+
 /** Element data type for amount set container */
 typedef void *ASElement;
 
@@ -63,6 +117,92 @@ typedef void (*FreeASElement)(ASElement);
  */
 typedef int (*CompareASElements)(ASElement, ASElement);
 
+/**
+ * Type of function used by a hashed set to index its elements.
+ * Elements which are equal according to the comparison function must have
+ * the same hash value.
+ */
+typedef unsigned int (*HashASElement)(ASElement);
+
+/**
+ * Type of function mapping an element to an integer key, used by a flat set
+ * to search its elements without calling the comparison function. Keys must
+ * be ordered like the elements: for any two elements the comparison function
+ * returns 0 if their keys are equal, and a negative integer if the key of the
+ * first element is smaller.
+ */
+typedef int64_t (*KeyASElement)(ASElement);
+
+/** Data structure used to keep the elements of the set in order */
+typedef enum ASBackend_t {
+    AS_BACKEND_LIST = 0,
+    AS_BACKEND_SKIP_LIST,
+    AS_BACKEND_FLAT
+} ASBackend;
+
+/**
+ * Hooks used by a set to allocate its internal nodes.
+ *
+ * createContext - Called once when a set is created. Its result is passed to
+ *     the other hooks of that set. May be NULL, in which case the context is
+ *     NULL. Returning NULL fails the creation of the set.
+ * destroyContext - Called once when the set is destroyed. If not NULL it must
+ *     release every node still allocated from the context, and the set does
+ *     not deallocate its nodes one by one. May be NULL.
+ * allocate - Returns a block of at least size bytes, aligned for any pointer
+ *     or double, or NULL on failure.
+ * deallocate - Releases a block returned by allocate, with the same size.
+ */
+typedef struct ASAllocator_t {
+    void *(*createContext)(void);
+    void (*destroyContext)(void *context);
+    void *(*allocate)(void *context, size_t size);
+    void (*deallocate)(void *context, void *ptr, size_t size);
+} ASAllocator;
+
+/**
+ * Creation time options of an amount set. A zero initialized ASOptions
+ * describes the set created by asCreate.
+ *
+ * backend - AS_BACKEND_LIST keeps the elements in a sorted linked list.
+ *     AS_BACKEND_SKIP_LIST adds skip list levels on top of it, so registering,
+ *     deleting and finding an element take expected logarithmic time.
+ *     AS_BACKEND_FLAT keeps elements and amounts in sorted arrays instead of
+ *     nodes. Finding an element is a binary search and iterating or summing
+ *     the set reads contiguous memory; registering and deleting move the
+ *     elements between the change and the previous one, and asRegisterBatch
+ *     merges a whole batch in one pass. A flat set can't have a hashElement
+ *     or an allocator.
+ * hashElement - If not NULL, the set also keeps a hash index of its elements
+ *     (@see asCreateHashed).
+ * allocator - If not NULL, the hooks used to allocate the set's nodes
+ *     (@see asCreateWithAllocator). Otherwise nodes are allocated with malloc.
+ * amountScale - If 0, amounts are stored as doubles. Otherwise amounts are
+ *     stored as integers counting 1/amountScale units: every amount passed to
+ *     the set is rounded to the nearest unit, and from then on all sums and
+ *     comparisons are exact, so many small changes never drift. For example
+ *     with an amountScale of 1000 amounts are kept to the nearest 0.001.
+ *     An amount whose count of units does not fit in an int64_t is rejected
+ *     with AS_INVALID_AMOUNT.
+ * keyElement - If not NULL, a flat set keeps the key of every element next to
+ *     it and searches the keys instead of comparing elements. Other backends
+ *     ignore it.
+ * atomicAmounts - If true, amounts are read and changed atomically, and a
+ *     change is a compare-and-swap loop which never makes an amount negative.
+ *     Several threads may then call asGetAmount, asChangeAmount,
+ *     asHandleGetAmount and asHandleChangeAmount on the set at once, even on
+ *     the same element, without a lock, as long as no thread changes which
+ *     elements are in the set meanwhile. Requires a non zero amountScale.
+ */
+typedef struct ASOptions_t {
+    ASBackend backend;
+    HashASElement hashElement;
+    const ASAllocator *allocator;
+    int64_t amountScale;
+    KeyASElement keyElement;
+    bool atomicAmounts;
+} ASOptions;
+
 /**
  * asCreate: Allocates a new empty amount set.
  *
@@ -80,6 +220,122 @@ AmountSet asCreate(CopyASElement copyElement,
                    FreeASElement freeElement,
                    CompareASElements compareElements);
 
+/**
+ * asCreateHashed: Allocates a new empty amount set which also keeps a hash
+ * index of its elements.
+ *
+ * The set behaves exactly like a set created by asCreate - it is still sorted
+ * and iterated in ascending order - but asContains, asGetAmount and
+ * asChangeAmount find the element in constant expected time instead of
+ * walking the whole set.
+ *
+ * @param copyElement - Function pointer to be used for copying elements into
+ *     the set or when copying the set.
+ * @param freeElement - Function pointer to be used for removing data elements from
+ *     the set.
+ * @param compareElements - Function pointer to be used for comparing elements
+ *     inside the set. Used to check if new elements already exist in the set.
+ * @param hashElement - Function pointer to be used for hashing elements.
+ *     Must be consistent with compareElements.
+ * @return
+ *     NULL - if one of the parameters is NULL or allocations failed.
+ *     A new amount set in case of success.
+ */
+AmountSet asCreateHashed(CopyASElement copyElement,
+                         FreeASElement freeElement,
+                         CompareASElements compareElements,
+                         HashASElement hashElement);
+
+/**
+ * asCreateOrdered: Allocates a new empty amount set backed by a skip list.
+ *
+ * asRegister, asDelete and the lookup functions take expected logarithmic
+ * time, and iteration is in ascending order as for any other set.
+ *
+ * @param copyElement - Function pointer to be used for copying elements into
+ *     the set or when copying the set.
+ * @param freeElement - Function pointer to be used for removing data elements from
+ *     the set.
+ * @param compareElements - Function pointer to be used for comparing elements
+ *     inside the set. Used to check if new elements already exist in the set.
+ * @return
+ *     NULL - if one of the parameters is NULL or allocations failed.
+ *     A new amount set in case of success.
+ */
+AmountSet asCreateOrdered(CopyASElement copyElement,
+                          FreeASElement freeElement,
+                          CompareASElements compareElements);
+
+/**
+ * asCreateWithAllocator: Allocates a new empty amount set whose nodes are
+ * allocated and deallocated through allocator.
+ *
+ * @param copyElement - Function pointer to be used for copying elements into
+ *     the set or when copying the set.
+ * @param freeElement - Function pointer to be used for removing data elements from
+ *     the set.
+ * @param compareElements - Function pointer to be used for comparing elements
+ *     inside the set. Used to check if new elements already exist in the set.
+ * @param allocator - The allocation hooks. Must stay valid while the set (or
+ *     a copy of it) exists.
+ * @return
+ *     NULL - if one of the parameters is NULL or allocations failed.
+ *     A new amount set in case of success.
+ */
+AmountSet asCreateWithAllocator(CopyASElement copyElement,
+                                FreeASElement freeElement,
+                                CompareASElements compareElements,
+                                const ASAllocator *allocator);
+
+/**
+ * asSlabAllocator: Returns the built in slab allocator.
+ *
+ * Every set using it gets its own slab. Nodes are handed out from cache line
+ * aligned chunks and deleted nodes are recycled through per size free lists,
+ * so heavy register/delete churn does not reach malloc. Destroying the set
+ * releases its chunks all at once.
+ *
+ * @return The slab allocator, to be passed to asCreateWithAllocator or set in
+ *     ASOptions.
+ */
+const ASAllocator *asSlabAllocator(void);
+
+/**
+ * asCreateWithOptions: Allocates a new empty amount set, using the backend and
+ * indexes described by options. All sets support the same functions; a copy
+ * of a set is created with the same options.
+ *
+ * @param copyElement - Function pointer to be used for copying elements into
+ *     the set or when copying the set.
+ * @param freeElement - Function pointer to be used for removing data elements from
+ *     the set.
+ * @param compareElements - Function pointer to be used for comparing elements
+ *     inside the set. Used to check if new elements already exist in the set.
+ * @param options - The options of the new set. Copied by the function.
+ * @return
+ *     NULL - if one of the parameters is NULL, options are not valid or
+ *     allocations failed.
+ *     A new amount set in case of success.
+ */
+AmountSet asCreateWithOptions(CopyASElement copyElement,
+                              FreeASElement freeElement,
+                              CompareASElements compareElements,
+                              const ASOptions *options);
+
+/**
+ * asAmountInRange: Checks that an amount can be kept by a set with the given
+ * amountScale (@see ASOptions), which is the range every amount passed to
+ * such a set, and every amount it reaches, must be in.
+ *
+ * @param amount - The amount to check.
+ * @param amountScale - The amountScale of the set. With 0 every amount is in
+ *     range.
+ * @return
+ *     true - if the count of 1/amountScale units in amount fits in an int64_t.
+ *     false - otherwise, or if amount is not a number.
+ */
+bool asAmountInRange(double amount, int64_t amountScale);
+
 /**
  * asDestroy: Deallocates an existing amount set. Clears all elements by using
  * the stored free functions.
@@ -156,6 +412,20 @@ bool asContains(AmountSet set, ASElement element);
  */
 AmountSetResult asGetAmount(AmountSet set, ASElement element, double *outAmount);
 
+/**
+ * asSumAmounts: Returns the sum of the amounts of all elements in the set.
+ *
+ * In a fixed point set (@see ASOptions) the sum is exact.
+ * Iterator's state is unchanged after this operation.
+ *
+ * @param set - The set whose amounts are summed.
+ * @param outSum - Pointer to the location where the sum is returned.
+ * @return
+ *     AS_NULL_ARGUMENT - if a NULL argument was passed.
+ *     AS_SUCCESS - if the sum was returned successfully.
+ */
+AmountSetResult asSumAmounts(AmountSet set, double *outSum);
+
 /**
  * asRegister: Add a new element into the set.
  *
@@ -171,6 +441,38 @@ AmountSetResult asGetAmount(AmountSet set, ASElement element, double *outAmount)
  */
 AmountSetResult asRegister(AmountSet set, ASElement element);
 
+/**
+ * asRegisterBatch: Add many new elements, with their initial amounts, into the
+ * set.
+ *
+ * The batch is sorted if it is not sorted already, and then merged into the
+ * set in a single pass, so registering n elements into a set of m elements
+ * takes O(n + m) when the batch is sorted. A failure of one element doesn't
+ * stop the batch: the result of every element is reported separately, and
+ * when an element appears in the batch more than once only its first
+ * occurrence is registered.
+ * Iterator's value is undefined after this operation.
+ *
+ * @param set - The target set to which the elements are added.
+ * @param elements - Array of count elements to add.
+ * @param amounts - Array of count initial amounts, matching elements. If NULL,
+ *     all elements are added with an amount of 0.
+ * @param count - The number of elements in the batch.
+ * @param results - Array of count results, filled with the result of each
+ *     element: AS_SUCCESS, AS_ITEM_ALREADY_EXISTS, AS_INSUFFICIENT_AMOUNT (a
+ *     negative amount), AS_INVALID_AMOUNT (an amount out of the set's range),
+ *     AS_NULL_ARGUMENT (a NULL element) or AS_OUT_OF_MEMORY.
+ *     May be NULL if the caller doesn't need them.
+ * @return
+ *     AS_NULL_ARGUMENT - if set or elements are NULL, or count is negative.
+ *     AS_OUT_OF_MEMORY - if the batch could not be prepared. Nothing is added.
+ *     AS_SUCCESS - if the batch was processed. Check results for the outcome
+ *         of each element.
+ */
+AmountSetResult asRegisterBatch(AmountSet set, ASElement *elements,
+                                const double *amounts, int count,
+                                AmountSetResult *results);
+
 /**
  * asChangeAmount: Increase or decrease the amount of an element in the set.
  *
@@ -188,6 +490,8 @@ AmountSetResult asRegister(AmountSet set, ASElement element);
  *         in the set is less than the amount that needs to be decreased (i.e.,
  *         if the change will result in a negative amount for the element in the
  *         set.)
+ *     AS_INVALID_AMOUNT - if amount, or the element's amount after the change,
+ *         is out of the set's range (@see ASOptions).
  *     AS_SUCCESS - if the element's amount was changed successfully.
  *
  * @note parameter amount doesn't affect the return value. Even if amount is 0,
@@ -197,6 +501,147 @@ AmountSetResult asRegister(AmountSet set, ASElement element);
  */
 AmountSetResult asChangeAmount(AmountSet set, ASElement element, const double amount);
 
+/**
+ * asFind: Returns a handle to the element in the set which is equal to element.
+ *
+ * Iterator's state is unchanged after this operation.
+ *
+ * @param set - The set to search in.
+ * @param element - The element to look for.
+ * @return
+ *     NULL if a NULL argument was passed or the element is not in the set.
+ *     A handle to the element otherwise.
+ */
+ASHandle asFind(AmountSet set, ASElement element);
+
+/**
+ * asRegisterOwned: Registers element itself, rather than a copy of it, into
+ * the set with an amount of 0, and returns a handle to it.
+ *
+ * On success the set takes ownership of element: it is freed with the set's
+ * free function when it is deleted, and the caller must not free it. On
+ * failure the caller keeps ownership. This saves the copy made by asRegister
+ * when the caller built element only to register it.
+ * Iterator's value is undefined after this operation.
+ *
+ * @param set - The target set.
+ * @param element - The element to add. Adopted by the set on success.
+ * @param outHandle - Pointer to the location where the handle of the new
+ *     element is returned on success. May be NULL.
+ * @return
+ *     AS_NULL_ARGUMENT - if a NULL argument was passed.
+ *     AS_OUT_OF_MEMORY - if an allocation failed.
+ *     AS_ITEM_ALREADY_EXISTS - if an equal element already exists in the set.
+ *     AS_SUCCESS - if the element was added successfully.
+ */
+AmountSetResult asRegisterOwned(AmountSet set, ASElement element,
+                                ASHandle *outHandle);
+
+/**
+ * asFindOrRegister: Returns a handle to the element in the set which is equal
+ * to element, registering a copy of element with an amount of 0 first if there
+ * is no such element.
+ *
+ * This is a single search of the set, where asContains followed by asRegister
+ * and asGetAmount would search it three times.
+ * Iterator's value is undefined after this operation.
+ *
+ * @param set - The target set.
+ * @param element - The element to find or add.
+ * @param outHandle - Pointer to the location where the handle is returned. In
+ *     case of failure, the contents of outHandle are unchanged.
+ * @return
+ *     AS_NULL_ARGUMENT - if a NULL argument was passed.
+ *     AS_OUT_OF_MEMORY - if an allocation failed.
+ *     AS_ITEM_ALREADY_EXISTS - if an equal element was already in the set.
+ *     AS_SUCCESS - if the element was added to the set.
+ */
+AmountSetResult asFindOrRegister(AmountSet set, ASElement element,
+                                 ASHandle *outHandle);
+
+/**
+ * asHandleGetElement: Returns the element a handle refers to.
+ *
+ * @param set - The set the handle belongs to.
+ * @param handle - A valid handle of the set.
+ * @return
+ *     NULL if a NULL argument was passed.
+ *     The element inside the set otherwise.
+ */
+ASElement asHandleGetElement(AmountSet set, ASHandle handle);
+
+/**
+ * asHandleGetAmount: Returns the amount of the element a handle refers to.
+ *
+ * @param set - The set the handle belongs to.
+ * @param handle - A valid handle of the set.
+ * @param outAmount - Pointer to the location where the amount is returned.
+ * @return
+ *     AS_NULL_ARGUMENT - if a NULL argument was passed.
+ *     AS_SUCCESS - if the amount was returned successfully.
+ */
+AmountSetResult asHandleGetAmount(AmountSet set, ASHandle handle,
+                                  double *outAmount);
+
+/**
+ * asHandleChangeAmount: Increase or decrease the amount of the element a
+ * handle refers to. Behaves like asChangeAmount without searching the set.
+ *
+ * @param set - The set the handle belongs to.
+ * @param handle - A valid handle of the set.
+ * @param amount - How much to change the element's amount.
+ * @return
+ *     AS_NULL_ARGUMENT - if a NULL argument was passed.
+ *     AS_INSUFFICIENT_AMOUNT - if the change would result in a negative amount.
+ *     AS_INVALID_AMOUNT - if amount, or the element's amount after the change,
+ *         is out of the set's range.
+ *     AS_SUCCESS - if the element's amount was changed successfully.
+ */
+AmountSetResult asHandleChangeAmount(AmountSet set, ASHandle handle,
+                                     const double amount);
+
+/**
+ * asHandleDelete: Delete the element a handle refers to from the set. The
+ * handle is invalid afterwards.
+ * Iterator's value is undefined after this operation.
+ *
+ * @param set - The set the handle belongs to.
+ * @param handle - A valid handle of the set.
+ * @return
+ *     AS_NULL_ARGUMENT - if a NULL argument was passed.
+ *     AS_SUCCESS - if the element was deleted successfully.
+ */
+AmountSetResult asHandleDelete(AmountSet set, ASHandle handle);
+
+/**
+ * asMergeApply: Add (or subtract) the amount of every element of source to (or
+ * from) the amount of the equal element in destination, as a single operation.
+ *
+ * Both sets must be ordered by the same comparison. They are walked together,
+ * once to check that every element of source exists in destination and that
+ * no amount would become negative, and once more to apply the changes, so the
+ * whole operation takes O(n + k) for sets of n and k elements. When
+ * destination is hashed and source is much smaller, the elements of source
+ * are looked up in the index instead, taking O(k).
+ * If the check fails nothing is changed.
+ * Iterator's state is unchanged after this operation, for both sets.
+ *
+ * @param destination - The set whose amounts are changed.
+ * @param source - The set holding the amounts to add or subtract.
+ * @param sign - A negative value subtracts the amounts of source, otherwise
+ *     they are added.
+ * @param checkOnly - If true, only check that the operation would succeed.
+ * @return
+ *     AS_NULL_ARGUMENT - if a NULL argument was passed.
+ *     AS_ITEM_DOES_NOT_EXIST - if an element of source is not in destination.
+ *     AS_INSUFFICIENT_AMOUNT - if an amount in destination would become
+ *         negative.
+ *     AS_INVALID_AMOUNT - if an amount would be out of destination's range.
+ *     AS_SUCCESS - if the amounts were (or, with checkOnly, can be) changed.
+ */
+AmountSetResult asMergeApply(AmountSet destination, AmountSet source,
+                             int sign, bool checkOnly);
+
 /**
  * asDelete: Delete an element completely from the set.
  *
@@ -263,4 +708,70 @@ ASElement asGetNext(AmountSet set);
         iterator ;                               \
         iterator = asGetNext(set))
 
+/**
+ * asIterBegin: Sets an external iterator to the first element of the set and
+ * returns that element. The set itself, including its internal iterator, is
+ * not changed.
+ *
+ * @param set - The set to iterate over.
+ * @param iterator - The iterator to initialize.
+ * @return
+ *     NULL if a NULL pointer was sent or the set is empty.
+ *     The first element of the set otherwise.
+ */
+ASElement asIterBegin(AmountSet set, ASIterator *iterator);
+
+/**
+ * asIterNext: Advances an external iterator to the next element in ascending
+ * order and returns it.
+ *
+ * @param iterator - An iterator initialized by asIterBegin.
+ * @return
+ *     NULL if a NULL pointer was sent or the end of the set was reached.
+ *     The next element of the set otherwise.
+ */
+ASElement asIterNext(ASIterator *iterator);
+
+/**
+ * asIterElement: Returns the current element of an external iterator.
+ *
+ * @param iterator - An iterator initialized by asIterBegin.
+ * @return
+ *     NULL if a NULL pointer was sent or the iteration is over.
+ *     The current element otherwise.
+ */
+ASElement asIterElement(const ASIterator *iterator);
+
+/**
+ * asIterAmount: Returns the amount of the current element of an external
+ * iterator, without searching the set for it.
+ *
+ * @param iterator - An iterator initialized by asIterBegin.
+ * @return
+ *     0 if a NULL pointer was sent or the iteration is over.
+ *     The current element's amount otherwise.
+ */
+double asIterAmount(const ASIterator *iterator);
+
+/**
+ * asIterHandle: Returns a handle to the current element of an external
+ * iterator (@see ASHandle).
+ *
+ * @param iterator - An iterator initialized by asIterBegin.
+ * @return
+ *     NULL if a NULL pointer was sent or the iteration is over.
+ *     A handle to the current element otherwise.
+ */
+ASHandle asIterHandle(const ASIterator *iterator);
+
+/**
+ * Macro for iterating over a set with an external iterator.
+ * Declares a new element variable for the loop; the iterator must be declared
+ * by the caller, and can be used inside the loop with asIterAmount.
+ */
+#define AS_FOREACH_ITER(type, element, iterator, set)          \
+    for(type element = (type) asIterBegin(set, &(iterator)) ; \
+        element ;                                             \
+        element = (type) asIterNext(&(iterator)))
+
 #endif /* AMOUNT_SET_H_ */
@@ -1,16 +1,40 @@
+#define _POSIX_C_SOURCE 200809L // for pthread_rwlock_t under -std=c99
+
 #include "matamazom.h"
 #include "amount_set.h"
 #include "matamazom_print.h"
-#include "list.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <assert.h>
-#include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
+
+/*
+ * Amounts are kept as integers counting millionths (@see ASOptions), and each
+ * amount type is valid within AMOUNT_TOLERANCE units of a multiple of its own
+ * quantum. An amount must also be in the range of the amount sets.
+ */
+#define AMOUNT_SCALE 1000000
+#define AMOUNT_TOLERANCE (AMOUNT_SCALE / 1000)
+#define INTEGER_QUANTUM AMOUNT_SCALE
+#define HALF_INTEGER_QUANTUM (AMOUNT_SCALE / 2)
+#define ANY_AMOUNT_QUANTUM 1
+#define PRODUCT_INDEX_INITIAL_CAPACITY 16
+#define NAME_CHUNK_SIZE 4096
+#define NAME_INDEX_INITIAL_CAPACITY 64
+#define ORDER_SLOTS_INITIAL_CAPACITY 16
+#define PRODUCT_ORDERS_INITIAL_CAPACITY 4
+#define PRODUCT_LOCK_STRIPES 64 // one bit each in a ProductStripes
+#define SHIP_WORKERS_MAX 16 // including the thread calling mtmShipOrders
+#define SHIP_PARALLEL_MIN_WAVE 32 // smaller waves are shipped by the caller
+#define STOCK_READ_ATTEMPTS 4 // then new stock changes wait for the read
 
 typedef struct Product_t {
-    char *name;
+    const char *name; // interned, owned by the Matamazom
     unsigned int product_id;
     MatamazomAmountType amountType;
     MtmProductData customData;
@@ -18,23 +42,138 @@ typedef struct Product_t {
     MtmCopyData copyData;
     MtmFreeData freeData;
     MtmGetProductPrice prodPrice;
+    bool linear_price; // the price of any amount is unit_price times amount
+    bool unit_price_valid;
+    double unit_price; // cached prodPrice of one unit
+    int64_t stock; // units in stock, with those held by reserved orders
+    unsigned int *order_ids; // the orders with a line of the product
+    int orders_count;
+    int orders_capacity;
 } *Product;
 
+/*
+ * The elements of an order's set are the products of the storage themselves:
+ * a line is the storage product and the amount ordered, and adding or
+ * copying a line never copies the product.
+ */
 typedef struct Order_t {
     unsigned int order_id;
     AmountSet products_in_order;
+    double total; // the sum of the prices of the lines
+    bool total_valid; // false after a price of a line was invalidated
+    bool reserved; // the amounts of all lines are out of the storage for it
+    bool owned; // a thread operates on the order (@see lockOrder)
 } *Order;
 
+/** An entry of the product index, empty while its handle is NULL */
+typedef struct ProductSlot_t {
+    unsigned int product_id;
+    ASHandle handle;
+} ProductSlot;
+
+/** A chunk of the name arena. Names are appended and never freed alone */
+typedef struct NameChunk_t {
+    struct NameChunk_t *next;
+    size_t used;
+    size_t size;
+    char names[];
+} *NameChunk;
+
+/** A set of product lock stripes, bit i standing for product_stripes[i] */
+typedef uint64_t ProductStripes;
+
+/** The locks of a Matamazom created by matamazomCreateConcurrent */
+typedef struct MatamazomLocks_t {
+    pthread_rwlock_t structure; // exclusive to add/remove products or scan them
+    pthread_mutex_t orders; // the table of orders, their owned flags and ids
+    pthread_cond_t order_released; // signalled when an owned order is released
+    int order_waiters; // the threads waiting for an owned order
+    pthread_mutex_t sales; // the sales of the products and the best sellers
+    pthread_mutex_t snapshots; // the references to the snapshots
+    pthread_mutex_t product_stripes[PRODUCT_LOCK_STRIPES];
+} *MatamazomLocks;
+
+/*
+ * The copies of the products of one product stripe, taken at its epoch. A
+ * segment is shared by the snapshots taken while the stripe did not change.
+ */
+typedef struct SnapshotSegment_t {
+    AmountSet products;
+    unsigned long epoch; // the storage_epochs of the stripe when copied
+    int references;
+} *SnapshotSegment;
+
+/*
+ * A snapshot is a copy of the storage, which is never changed after it is
+ * taken, with the unit price of every product already cached. It is made of
+ * a segment for every product stripe, and products lists the copies of all
+ * segments by id. It is freed when its last reference is released; the
+ * Matamazom keeps a reference to its latest snapshot, to hand out again
+ * while the storage is unchanged and to share its segments with the next.
+ */
+struct MatamazomSnapshot_t {
+    Matamazom owner;
+    AmountSet products; // the copies of the segments, not owned, by stock
+    unsigned long stock_version; // the stock changes started when it was read
+    SnapshotSegment segments[PRODUCT_LOCK_STRIPES];
+    int references;
+};
+
+/*
+ * A batch of orders being shipped by mtmShipOrders. schedule lists the
+ * positions of the batch wave by wave; the workers ship the positions
+ * between wave_begin and wave_end, each taking the next one in turn.
+ */
+typedef struct ShipBatch_t {
+    Matamazom matamazom;
+    const unsigned int *order_ids;
+    MatamazomResult *results;
+    int *schedule;
+    int wave_begin;
+    int wave_end;
+    int next; // the next position of schedule to ship, taken atomically
+    int busy_workers; // the workers which did not finish the current wave
+    unsigned long wave_number; // changes when a wave is handed to the workers
+    bool finished;
+    pthread_mutex_t mutex;
+    pthread_cond_t wave_ready;
+    pthread_cond_t wave_done;
+} *ShipBatch;
+
 struct Matamazom_t {
     AmountSet storage;
-    List orders;
+    Order *orders; // orders[i] is the order with id orders_base + i, or NULL
+    unsigned int orders_base;
+    int orders_capacity;
     unsigned int number_of_orders;
+    ProductSlot *product_index; // id -> handle of the product in storage
+    int product_index_capacity;
+    AmountSet best_sellers; // the products with sales, the best seller first
+    bool best_sellers_stale; // an update failed, rebuild before reading
+    NameChunk name_chunks; // the newest chunk first
+    const char **name_index; // the interned names, to find them again
+    int name_index_capacity;
+    int names_count;
+    MatamazomLocks locks; // NULL unless created by matamazomCreateConcurrent
+    MatamazomSnapshot snapshot; // the latest snapshot, or NULL
+    // storage_epochs[i] changes with the products of product stripe i
+    unsigned long storage_epochs[PRODUCT_LOCK_STRIPES];
+    // the stock changes started and finished (@see beginStockChange)
+    unsigned long stock_changes_started;
+    unsigned long stock_changes_finished;
+    int stock_readers_waited; // while positive, new stock changes wait
 };
 
 static bool nameIsValid(const char *name);
 
 static bool checkAmountType(double amount, MatamazomAmountType type);
 
+static int64_t toUnits(double amount);
+
+static MatamazomResult reserveOrder(Matamazom matamazom, Order order);
+
+static void releaseOrder(Matamazom matamazom, Order order);
+
 
 static ASElement copyProduct(ASElement product);
 
@@ -42,16 +181,183 @@ static void freeProduct(ASElement product);
 
 static int compareProduct(ASElement product1, ASElement product2);
 
-static Product findProduct(AmountSet storage, const unsigned int id);
+static ASElement copyLine(ASElement product);
+
+static void freeLine(ASElement product);
+
+static unsigned int hashProduct(ASElement product);
+
+static Product findProduct(Matamazom matamazom, const unsigned int id);
+
+static ASHandle findProductHandle(Matamazom matamazom, const unsigned int id);
+
+static unsigned int hashProductId(unsigned int id);
+
+static const char *internName(Matamazom matamazom, const char *name);
+
+static char *allocateName(Matamazom matamazom, size_t size);
+
+static bool nameIndexReserve(Matamazom matamazom, int needed_size);
+
+static void nameIndexInsert(Matamazom matamazom, const char *name);
+
+static unsigned int hashName(const char *name);
+
+static bool productIndexReserve(Matamazom matamazom, int needed_size);
+
+static void productIndexInsert(Matamazom matamazom, unsigned int id,
+                               ASHandle handle);
+
+static void productIndexRemove(Matamazom matamazom, unsigned int id);
+
+static void freeOrder(Order order);
+
+static Order findOrder(Matamazom matamazom, unsigned int orderId);
+
+static Order orderSlot(Matamazom matamazom, unsigned int orderId);
+
+static bool reserveOrderSlot(Matamazom matamazom, unsigned int orderId);
+
+static void removeOrder(Matamazom matamazom, Order order);
+
+static bool addProductOrder(Matamazom matamazom, Product product,
+                            unsigned int orderId);
+
+static void removeProductOrder(Matamazom matamazom, Product product,
+                               unsigned int orderId);
+
+static int compareSales(ASElement product1, ASElement product2);
+
+static double unitPrice(Product product);
+
+static double stockAmount(Product product);
+
+static double productPrice(Product product, double amount);
+
+static double linePrice(Product product, double amount);
+
+static double orderTotal(Order order);
+
+static void addSales(Matamazom matamazom, Product product, double sales);
+
+static bool refreshBestSellers(Matamazom matamazom);
+
+static MatamazomResult newProduct(Matamazom matamazom, const unsigned int id,
+                                  const char *name, const double amount,
+                                  const MatamazomAmountType amountType,
+                                  const MtmProductData customData,
+                                  MtmCopyData copyData, MtmFreeData freeData,
+                                  MtmGetProductPrice prodPrice,
+                                  bool linearPricing);
+
+static MatamazomResult changeProductAmount(Matamazom matamazom,
+                                           const unsigned int id,
+                                           const double amount);
+
+static MatamazomResult invalidatePrice(Matamazom matamazom,
+                                       const unsigned int id);
+
+static MatamazomResult clearProduct(Matamazom matamazom, const unsigned int id);
+
+static MatamazomResult changeProductAmountInOrder(Matamazom matamazom,
+                                                  const unsigned int orderId,
+                                                  const unsigned int productId,
+                                                  const double amount);
+
+static MatamazomResult shipOrder(Matamazom matamazom,
+                                 const unsigned int orderId);
+
+static MatamazomResult cancelOrder(Matamazom matamazom,
+                                   const unsigned int orderId);
+
+static MatamazomResult printInventory(AmountSet products, bool stockInSet,
+                                      FILE *output);
+
+static MatamazomResult printOrder(Matamazom matamazom,
+                                  const unsigned int orderId, FILE *output);
+
+static MatamazomResult printBestSelling(Matamazom matamazom, FILE *output);
+
+static int getTopSellers(Matamazom matamazom, int k, unsigned int *out);
+
+static MatamazomResult printFiltered(AmountSet products, bool stockInSet,
+                                     MtmFilterProduct customFilter,
+                                     FILE *output);
+
+static MatamazomSnapshot takeSnapshot(Matamazom matamazom);
+
+static MatamazomSnapshot currentSnapshot(Matamazom matamazom);
+
+static void publishSnapshot(Matamazom matamazom, MatamazomSnapshot snapshot);
+
+static SnapshotSegment newSegment(unsigned long epoch);
+
+static bool listSnapshotProducts(Matamazom matamazom,
+                                 MatamazomSnapshot snapshot);
+
+static unsigned long readStock(Matamazom matamazom, int64_t *stock);
+
+static void beginStockChange(Matamazom matamazom);
+
+static void endStockChange(Matamazom matamazom);
+
+static MatamazomResult shipOwnedOrders(Matamazom matamazom,
+                                       const unsigned int *orderIds, int n,
+                                       MatamazomResult *results);
+
+static int compareOrderIds(const void *id1, const void *id2);
 
-static ListElement copyOrder(ListElement order);
+static bool planShipWaves(Matamazom matamazom, const unsigned int *orderIds,
+                          int n, int *waves, int *outWavesCount);
 
-static void freeOrder(ListElement order);
+static void shipBatch(ShipBatch batch, const int *waveStarts, int wavesCount);
 
-static Order findOrder(List orders, unsigned int orderId);
+static bool initShipBatchLocks(ShipBatch batch);
 
-static Product findProductInOrder(AmountSet products_in_order,
-                                  unsigned int productId);
+static void destroyShipBatchLocks(ShipBatch batch);
+
+static void *shipWorker(void *batch);
+
+static void shipWave(ShipBatch batch);
+
+
+static void touchStorage(Matamazom matamazom, ProductStripes stripes);
+
+static bool initLocks(MatamazomLocks locks);
+
+static void destroyLocks(MatamazomLocks locks);
+
+static void lockStructure(Matamazom matamazom, bool exclusive);
+
+static void unlockStructure(Matamazom matamazom);
+
+static Order lockOrder(Matamazom matamazom, unsigned int orderId);
+
+static void unlockOrder(Matamazom matamazom, unsigned int orderId);
+
+static Order ownOrder(Matamazom matamazom, unsigned int orderId);
+
+static void disownOrder(Matamazom matamazom, unsigned int orderId);
+
+static int productStripeIndex(unsigned int id);
+
+static ProductStripes productStripe(unsigned int id);
+
+static ProductStripes lockProducts(Matamazom matamazom, ProductStripes stripes);
+
+static void unlockProducts(Matamazom matamazom, ProductStripes stripes);
+
+static void lockOrders(Matamazom matamazom);
+
+static void unlockOrders(Matamazom matamazom);
+
+static void lockSales(Matamazom matamazom);
+
+static void unlockSales(Matamazom matamazom);
+
+static void lockSnapshots(Matamazom matamazom);
+
+static void unlockSnapshots(Matamazom matamazom);
 
 Matamazom matamazomCreate() {
     Matamazom matamazom = malloc(sizeof(*matamazom));
@@ -60,7 +366,40 @@ Matamazom matamazomCreate() {
     }
     matamazom->storage = NULL;
     matamazom->orders = NULL;
+    matamazom->orders_base = 1;
+    matamazom->orders_capacity = 0;
     matamazom->number_of_orders = 0;
+    matamazom->product_index = NULL;
+    matamazom->product_index_capacity = 0;
+    matamazom->best_sellers = NULL;
+    matamazom->best_sellers_stale = false;
+    matamazom->name_chunks = NULL;
+    matamazom->name_index = NULL;
+    matamazom->name_index_capacity = 0;
+    matamazom->names_count = 0;
+    matamazom->locks = NULL;
+    matamazom->snapshot = NULL;
+    for (int i = 0; i < PRODUCT_LOCK_STRIPES; i++) {
+        matamazom->storage_epochs[i] = 0;
+    }
+    matamazom->stock_changes_started = 0;
+    matamazom->stock_changes_finished = 0;
+    matamazom->stock_readers_waited = 0;
+    return matamazom;
+}
+
+Matamazom matamazomCreateConcurrent() {
+    Matamazom matamazom = matamazomCreate();
+    if (matamazom == NULL) {
+        return NULL;
+    }
+    matamazom->locks = malloc(sizeof(*matamazom->locks));
+    if (matamazom->locks == NULL || !initLocks(matamazom->locks)) {
+        free(matamazom->locks);
+        matamazom->locks = NULL;
+        matamazomDestroy(matamazom);
+        return NULL;
+    }
     return matamazom;
 }
 
@@ -68,8 +407,24 @@ void matamazomDestroy(Matamazom matamazom) {
     if (matamazom == NULL) {
         return;
     }
+    mtmSnapshotRelease(matamazom->snapshot);
     asDestroy(matamazom->storage);
-    listDestroy(matamazom->orders);
+    for (int i = 0; i < matamazom->orders_capacity; i++) {
+        freeOrder(matamazom->orders[i]);
+    }
+    free(matamazom->orders);
+    free(matamazom->product_index);
+    asDestroy(matamazom->best_sellers);
+    while (matamazom->name_chunks != NULL) { // all names are released at once
+        NameChunk to_delete = matamazom->name_chunks;
+        matamazom->name_chunks = to_delete->next;
+        free(to_delete);
+    }
+    free(matamazom->name_index);
+    if (matamazom->locks != NULL) {
+        destroyLocks(matamazom->locks);
+        free(matamazom->locks);
+    }
     free(matamazom);
 }
 
@@ -78,13 +433,46 @@ mtmNewProduct(Matamazom matamazom, const unsigned int id, const char *name,
               const double amount, const MatamazomAmountType amountType,
               const MtmProductData customData, MtmCopyData copyData,
               MtmFreeData freeData, MtmGetProductPrice prodPrice) {
+    return mtmNewProductWithPricing(matamazom, id, name, amount, amountType,
+                                    customData, copyData, freeData, prodPrice,
+                                    false);
+}
+
+MatamazomResult
+mtmNewProductWithPricing(Matamazom matamazom, const unsigned int id,
+                         const char *name, const double amount,
+                         const MatamazomAmountType amountType,
+                         const MtmProductData customData, MtmCopyData copyData,
+                         MtmFreeData freeData, MtmGetProductPrice prodPrice,
+                         bool linearPricing) {
     if (matamazom == NULL || name == NULL || customData == NULL ||
         freeData == NULL ||
         prodPrice == NULL || copyData == NULL) {
         return MATAMAZOM_NULL_ARGUMENT;
     }
+    lockStructure(matamazom, true);
+    MatamazomResult result = newProduct(matamazom, id, name, amount,
+                                        amountType, customData, copyData,
+                                        freeData, prodPrice, linearPricing);
+    unlockStructure(matamazom);
+    return result;
+}
+
+static MatamazomResult
+newProduct(Matamazom matamazom, const unsigned int id, const char *name,
+           const double amount, const MatamazomAmountType amountType,
+           const MtmProductData customData, MtmCopyData copyData,
+           MtmFreeData freeData, MtmGetProductPrice prodPrice,
+           bool linearPricing) {
     if (matamazom->storage == NULL) {
-        matamazom->storage = asCreate(copyProduct, freeProduct, compareProduct);
+        // a skip list keeps registering and deleting logarithmic, and stock
+        // counters are swapped atomically, so they need no lock. Products are
+        // found through the product index, so the storage keeps no index
+        ASOptions storage_options = {AS_BACKEND_SKIP_LIST, NULL, NULL,
+                                     AMOUNT_SCALE, NULL, true};
+        matamazom->storage = asCreateWithOptions(copyProduct, freeProduct,
+                                                 compareProduct,
+                                                 &storage_options);
         if (matamazom->storage == NULL) {
             return MATAMAZOM_OUT_OF_MEMORY;
         }
@@ -96,38 +484,60 @@ mtmNewProduct(Matamazom matamazom, const unsigned int id, const char *name,
     if (amount < 0 || !checkAmountType(amount, amountType)) {
         return MATAMAZOM_INVALID_AMOUNT;
     }
+    if (findProductHandle(matamazom, id) != NULL) {
+        return MATAMAZOM_PRODUCT_ALREADY_EXIST;
+    }
+    const char *interned_name = internName(matamazom, name);
+    if (interned_name == NULL) {
+        return MATAMAZOM_OUT_OF_MEMORY;
+    }
     Product new_product = malloc(sizeof(*new_product));
     if (new_product == NULL) {
         return MATAMAZOM_OUT_OF_MEMORY;
     }
     new_product->product_id = id;
-    int str_len = strlen(name);
-    new_product->name = malloc(sizeof(const char *) * str_len + 1);
-    if (new_product->name == NULL) {
-        return MATAMAZOM_OUT_OF_MEMORY;
-    }
-    strcpy(new_product->name, name);
+    new_product->name = interned_name;
     new_product->amountType = amountType;
     new_product->prodPrice = prodPrice;
+    new_product->linear_price = linearPricing;
+    new_product->unit_price_valid = false;
+    new_product->unit_price = 0;
+    new_product->stock = toUnits(amount);
     new_product->sales = 0;
     new_product->copyData = copyData;
     new_product->freeData = freeData;
     new_product->customData = copyData(customData);
+    new_product->order_ids = NULL;
+    new_product->orders_count = 0;
+    new_product->orders_capacity = 0;
 
-    AmountSetResult registration_result = asRegister(matamazom->storage,
-                                                     new_product);
+    if (!productIndexReserve(matamazom, asGetSize(matamazom->storage) + 1)) {
+        freeProduct(new_product);
+        return MATAMAZOM_OUT_OF_MEMORY;
+    }
+    // the storage adopts new_product, so it is neither copied nor searched
+    ASHandle registered_product = NULL;
+    AmountSetResult registration_result = asRegisterOwned(matamazom->storage,
+                                                          new_product,
+                                                          &registered_product);
     assert(registration_result != AS_NULL_ARGUMENT);
-    freeProduct(new_product);
-
-    Product registered_product = findProduct(matamazom->storage, id);
-
+    if (registration_result != AS_SUCCESS) {
+        freeProduct(new_product);
+    }
     if (registration_result == AS_ITEM_ALREADY_EXISTS) {
         return MATAMAZOM_PRODUCT_ALREADY_EXIST;
     }
     if (registration_result == AS_OUT_OF_MEMORY) {
         return MATAMAZOM_OUT_OF_MEMORY;
     }
-    asChangeAmount(matamazom->storage, registered_product, amount);
+    productIndexInsert(matamazom, id, registered_product);
+    if (asHandleChangeAmount(matamazom->storage, registered_product,
+                             amount) != AS_SUCCESS) {
+        productIndexRemove(matamazom, id);
+        asHandleDelete(matamazom->storage, registered_product);
+        return MATAMAZOM_INVALID_AMOUNT;
+    }
+    touchStorage(matamazom, productStripe(id));
     return MATAMAZOM_SUCCESS;
 }
 
@@ -137,22 +547,69 @@ MatamazomResult mtmChangeProductAmount(Matamazom matamazom,
     if (matamazom == NULL) {
         return MATAMAZOM_NULL_ARGUMENT;
     }
+    lockStructure(matamazom, false);
+    MatamazomResult result = changeProductAmount(matamazom, id, amount);
+    unlockStructure(matamazom);
+    return result;
+}
+
+static MatamazomResult changeProductAmount(Matamazom matamazom,
+                                           const unsigned int id,
+                                           const double amount) {
     if (matamazom->storage == NULL) { // checks if the storage is empty
         return MATAMAZOM_PRODUCT_NOT_EXIST;
     }
-    Product product_in_storage = findProduct(matamazom->storage, id);
+    ASHandle product_in_storage = findProductHandle(matamazom, id);
     if (product_in_storage == NULL) {
         return MATAMAZOM_PRODUCT_NOT_EXIST;
     }
-    if (!checkAmountType(amount, product_in_storage->amountType)) {
+    Product product = asHandleGetElement(matamazom->storage,
+                                         product_in_storage);
+    if (!checkAmountType(amount, product->amountType)) {
         return MATAMAZOM_INVALID_AMOUNT;
     }
-    AmountSetResult changing_result = asChangeAmount(matamazom->storage,
-                                                     product_in_storage,
-                                                     amount);
+    // the storage holds the stock not reserved, so reserved stock stays
+    AmountSetResult changing_result = asHandleChangeAmount(matamazom->storage,
+                                                           product_in_storage,
+                                                           amount);
     if (changing_result == AS_INSUFFICIENT_AMOUNT) {
         return MATAMAZOM_INSUFFICIENT_AMOUNT;
     }
+    if (changing_result == AS_INVALID_AMOUNT) {
+        return MATAMAZOM_INVALID_AMOUNT; // the stock would be out of range
+    }
+    beginStockChange(matamazom);
+    __atomic_add_fetch(&product->stock, toUnits(amount), __ATOMIC_RELEASE);
+    endStockChange(matamazom);
+    return MATAMAZOM_SUCCESS;
+}
+
+MatamazomResult mtmInvalidatePrice(Matamazom matamazom, const unsigned int id) {
+    if (matamazom == NULL) {
+        return MATAMAZOM_NULL_ARGUMENT;
+    }
+    // the totals of orders edited by other threads are invalidated
+    lockStructure(matamazom, true);
+    MatamazomResult result = invalidatePrice(matamazom, id);
+    unlockStructure(matamazom);
+    return result;
+}
+
+static MatamazomResult invalidatePrice(Matamazom matamazom,
+                                       const unsigned int id) {
+    Product product = findProduct(matamazom, id);
+    if (product == NULL) {
+        return MATAMAZOM_PRODUCT_NOT_EXIST;
+    }
+    product->unit_price_valid = false;
+    touchStorage(matamazom, productStripe(id));
+    // the totals of the orders with a line of the product are recomputed
+    for (int i = 0; i < product->orders_count; i++) {
+        Order order = findOrder(matamazom, product->order_ids[i]);
+        if (order != NULL) {
+            order->total_valid = false;
+        }
+    }
     return MATAMAZOM_SUCCESS;
 }
 
@@ -160,24 +617,46 @@ MatamazomResult mtmClearProduct(Matamazom matamazom, const unsigned int id) {
     if (matamazom == NULL) {
         return MATAMAZOM_NULL_ARGUMENT;
     }
+    lockStructure(matamazom, true);
+    MatamazomResult result = clearProduct(matamazom, id);
+    unlockStructure(matamazom);
+    return result;
+}
+
+static MatamazomResult clearProduct(Matamazom matamazom, const unsigned int id) {
     if (matamazom->storage == NULL) { // the storage hasn't been initialized
         return MATAMAZOM_SUCCESS;
     }
-    Product product_to_delete = findProduct(matamazom->storage, id);
+    ASHandle handle_to_delete = findProductHandle(matamazom, id);
+    if (handle_to_delete == NULL) {
+        return MATAMAZOM_PRODUCT_NOT_EXIST;
+    }
+    Product product_to_delete = asHandleGetElement(matamazom->storage,
+                                                   handle_to_delete);
     if (product_to_delete == NULL) {
         return MATAMAZOM_PRODUCT_NOT_EXIST;
     }
-    LIST_FOREACH(Order, order, matamazom->orders) {
-        AS_FOREACH(Product, product, order->products_in_order) {
-            if (product->product_id == id) {
-                asDelete(order->products_in_order, product);
-                break;
-            }
+    // only the orders which have a line of the product are visited
+    for (int i = 0; i < product_to_delete->orders_count; i++) {
+        Order order = findOrder(matamazom, product_to_delete->order_ids[i]);
+        if (order == NULL) { // shipped or cancelled
+            continue;
         }
+        ASHandle line = asFind(order->products_in_order, product_to_delete);
+        assert(line != NULL);
+        double line_amount = 0;
+        asHandleGetAmount(order->products_in_order, line, &line_amount);
+        order->total -= linePrice(product_to_delete, line_amount);
+        asHandleDelete(order->products_in_order, line);
     }
     //delete inner object in the product struct
     assert (matamazom->storage != NULL && product_to_delete != NULL);
-    asDelete(matamazom->storage, product_to_delete);
+    if (matamazom->best_sellers != NULL) {
+        asDelete(matamazom->best_sellers, product_to_delete);
+    }
+    productIndexRemove(matamazom, id);
+    asHandleDelete(matamazom->storage, handle_to_delete);
+    touchStorage(matamazom, productStripe(id));
     return MATAMAZOM_SUCCESS;
 }
 
@@ -185,27 +664,30 @@ unsigned int mtmCreateNewOrder(Matamazom matamazom) {
     if (matamazom == NULL) {
         return 0;
     }
-    if (matamazom->orders == NULL) {
-        matamazom->orders = listCreate(copyOrder, freeOrder);
-        if (matamazom->orders == NULL) {
-            return 0;
-        }
-    }
     Order new_order = malloc(sizeof(*new_order));
     if (new_order == NULL) {
         return 0;
     }
-    new_order->order_id = ++(matamazom->number_of_orders);
     new_order->products_in_order = NULL;
-    ListResult creation_result = listInsertLast(matamazom->orders, new_order);
-    // inserts the order in the end
-
-    if (creation_result == LIST_NULL_ARGUMENT
-        || creation_result == LIST_OUT_OF_MEMORY) {
+    new_order->total = 0;
+    new_order->total_valid = true;
+    new_order->reserved = false;
+    new_order->owned = false;
+    lockStructure(matamazom, false);
+    lockOrders(matamazom);
+    unsigned int given_id = matamazom->number_of_orders + 1;
+    bool has_slot = reserveOrderSlot(matamazom, given_id);
+    if (has_slot) {
+        new_order->order_id = given_id;
+        matamazom->orders[given_id - matamazom->orders_base] = new_order;
+        matamazom->number_of_orders = given_id;
+    }
+    unlockOrders(matamazom);
+    unlockStructure(matamazom);
+    if (!has_slot) {
+        free(new_order);
         return 0;
     }
-    unsigned int given_id = new_order->order_id;
-    free(new_order);
     return given_id;
 }
 
@@ -216,14 +698,23 @@ MatamazomResult mtmChangeProductAmountInOrder(Matamazom matamazom,
     if (matamazom == NULL) {
         return MATAMAZOM_NULL_ARGUMENT;
     }
-    if (matamazom->orders == NULL) {
-        return MATAMAZOM_ORDER_NOT_EXIST;
-    }
-    Order order_ptr = findOrder(matamazom->orders, orderId);
+    // the product is read without a lock, only its list of orders is locked
+    lockOrder(matamazom, orderId);
+    MatamazomResult result = changeProductAmountInOrder(matamazom, orderId,
+                                                        productId, amount);
+    unlockOrder(matamazom, orderId);
+    return result;
+}
+
+static MatamazomResult changeProductAmountInOrder(Matamazom matamazom,
+                                                  const unsigned int orderId,
+                                                  const unsigned int productId,
+                                                  const double amount) {
+    Order order_ptr = findOrder(matamazom, orderId);
     if (order_ptr == NULL) {
         return MATAMAZOM_ORDER_NOT_EXIST;
     }
-    Product product_ptr = findProduct(matamazom->storage, productId);
+    Product product_ptr = findProduct(matamazom, productId);
     if (product_ptr == NULL) {
         return MATAMAZOM_PRODUCT_NOT_EXIST;
     }
@@ -236,37 +727,47 @@ MatamazomResult mtmChangeProductAmountInOrder(Matamazom matamazom,
     }
     assert(order_ptr != NULL && product_ptr != NULL);
 
+    // the reservation is for the lines as they were
+    releaseOrder(matamazom, order_ptr);
     // registering the product to the order
     if (order_ptr->products_in_order == NULL) {
-        order_ptr->products_in_order = asCreate(copyProduct, freeProduct,
-                                                compareProduct);
-    }
-    AmountSetResult registration_result = asRegister(
-            order_ptr->products_in_order, product_ptr);
-
-    if (registration_result ==
-        AS_ITEM_ALREADY_EXISTS) { // the product was already in the order
-        AmountSetResult changing_result = asChangeAmount(
-                order_ptr->products_in_order, product_ptr, amount);
-        double updated_amount = 0;
-        asGetAmount(order_ptr->products_in_order, product_ptr, &updated_amount);
-        if (changing_result ==
-            AS_INSUFFICIENT_AMOUNT || updated_amount == 0) {
-            // if the amount to decrease was larger/equal than the amount in order
-            assert(order_ptr->products_in_order != NULL && product_ptr != NULL);
-            asDelete(order_ptr->products_in_order, product_ptr);
-        }
-        if (changing_result ==
-            AS_SUCCESS) {
-            // amount to increase was added the the amount of the product
-            return MATAMAZOM_SUCCESS;
-        }
-    }
-    if (registration_result ==
-        AS_SUCCESS) { // item that was not in the order was added
-        asChangeAmount(order_ptr->products_in_order, product_ptr,
-                       amount); // * removed variable name
+        ASOptions order_options = {AS_BACKEND_LIST, NULL, NULL, AMOUNT_SCALE};
+        order_ptr->products_in_order = asCreateWithOptions(copyLine, freeLine,
+                                                           compareProduct,
+                                                           &order_options);
+        if (order_ptr->products_in_order == NULL) {
+            return MATAMAZOM_OUT_OF_MEMORY;
+        }
+    }
+    ASHandle line = NULL;
+    AmountSetResult registration_result = asFindOrRegister(
+            order_ptr->products_in_order, product_ptr, &line);
+    if (registration_result == AS_OUT_OF_MEMORY) {
+        return MATAMAZOM_OUT_OF_MEMORY;
+    }
+    if (registration_result == AS_SUCCESS &&
+        !addProductOrder(matamazom, product_ptr, orderId)) {
+        asHandleDelete(order_ptr->products_in_order, line);
+        return MATAMAZOM_OUT_OF_MEMORY;
+    }
+    // a product that was not in the order was added with an amount of 0
+    double previous_amount = 0;
+    asHandleGetAmount(order_ptr->products_in_order, line, &previous_amount);
+    AmountSetResult changing_result = asHandleChangeAmount(
+            order_ptr->products_in_order, line, amount);
+    if (changing_result == AS_INVALID_AMOUNT) {
+        return MATAMAZOM_INVALID_AMOUNT; // the line would be out of range
+    }
+    double updated_amount = 0;
+    asHandleGetAmount(order_ptr->products_in_order, line, &updated_amount);
+    if (changing_result == AS_INSUFFICIENT_AMOUNT || updated_amount == 0) {
+        // if the amount to decrease was larger/equal than the amount in order
+        asHandleDelete(order_ptr->products_in_order, line);
+        removeProductOrder(matamazom, product_ptr, orderId);
+        updated_amount = 0;
     }
+    order_ptr->total += linePrice(product_ptr, updated_amount) -
+                        linePrice(product_ptr, previous_amount);
     return MATAMAZOM_SUCCESS;
 }
 
@@ -274,81 +775,217 @@ MatamazomResult mtmShipOrder(Matamazom matamazom, const unsigned int orderId) {
     if (matamazom == NULL) {
         return MATAMAZOM_NULL_ARGUMENT;
     }
-    Order current_order = findOrder(matamazom->orders, orderId);
+    lockOrder(matamazom, orderId);
+    MatamazomResult result = shipOrder(matamazom, orderId);
+    unlockOrder(matamazom, orderId);
+    return result;
+}
+
+static MatamazomResult shipOrder(Matamazom matamazom,
+                                 const unsigned int orderId) {
+    Order current_order = findOrder(matamazom, orderId);
     if (current_order == NULL) {
         return MATAMAZOM_ORDER_NOT_EXIST;
     }
-    double amount_in_order;
-    double amount_in_storage;
-    //check all products for insufficient amount
-    AS_FOREACH(Product, prod_in_order,
-               current_order->products_in_order) {
-        Product product_in_storage = findProduct(matamazom->storage,
-                                                 prod_in_order->product_id);
-        asGetAmount(current_order->products_in_order, prod_in_order,
-                    &amount_in_order);
-        asGetAmount(matamazom->storage, product_in_storage, &amount_in_storage);
-        if (amount_in_order > amount_in_storage) {
-            return MATAMAZOM_INSUFFICIENT_AMOUNT;
+    // an order which was not reserved is checked for insufficient amounts
+    MatamazomResult reservation_result = reserveOrder(matamazom,
+                                                      current_order);
+    if (reservation_result != MATAMAZOM_SUCCESS) {
+        return reservation_result;
+    }
+    // the reserved amounts already left the storage, so only the stock drops,
+    // for all lines in a single change
+    ASIterator line;
+    beginStockChange(matamazom);
+    AS_FOREACH_ITER(Product, product_in_storage, line,
+                    current_order->products_in_order) {
+        __atomic_sub_fetch(&product_in_storage->stock,
+                           toUnits(asIterAmount(&line)), __ATOMIC_RELEASE);
+    }
+    endStockChange(matamazom);
+    AS_FOREACH_ITER(Product, product_in_storage, line,
+                    current_order->products_in_order) {
+        double line_amount = asIterAmount(&line);
+        addSales(matamazom, product_in_storage,
+                 productPrice(product_in_storage, line_amount));
+    }
+    current_order->reserved = false;
+    removeOrder(matamazom, current_order);
+    return MATAMAZOM_SUCCESS;
+
+}
+
+MatamazomResult mtmShipOrders(Matamazom matamazom,
+                              const unsigned int *orderIds, int n,
+                              MatamazomResult *results) {
+    if (matamazom == NULL || (n > 0 && (orderIds == NULL || results == NULL))) {
+        return MATAMAZOM_NULL_ARGUMENT;
+    }
+    if (matamazom->locks == NULL) { // not thread safe, so shipped in turn
+        for (int i = 0; i < n; i++) {
+            results[i] = shipOrder(matamazom, orderIds[i]);
+        }
+        return MATAMAZOM_SUCCESS;
+    }
+    if (n <= 0) {
+        return MATAMAZOM_SUCCESS;
+    }
+    // the orders are taken over in increasing ids, so batches never wait for
+    // each other in a cycle, and none of them is edited until it is shipped
+    unsigned int *owned_ids = malloc(sizeof(*owned_ids) * n);
+    if (owned_ids == NULL) {
+        return MATAMAZOM_OUT_OF_MEMORY;
+    }
+    memcpy(owned_ids, orderIds, sizeof(*owned_ids) * n);
+    qsort(owned_ids, n, sizeof(*owned_ids), compareOrderIds);
+    lockStructure(matamazom, false);
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || owned_ids[i] != owned_ids[i - 1]) {
+            ownOrder(matamazom, owned_ids[i]);
         }
     }
-    //update amount and sales for each product of the order in the storage
-    AS_FOREACH(Product, prod_in_order,
-               current_order->products_in_order) {
-        Product product_in_storage = findProduct(matamazom->storage,
-                                                 prod_in_order->product_id);
-        asGetAmount(current_order->products_in_order, prod_in_order,
-                    &amount_in_order);
-        product_in_storage->sales += prod_in_order->prodPrice(
-                prod_in_order->customData,
-                amount_in_order);
-        asChangeAmount(matamazom->storage, product_in_storage,
-                       amount_in_order * -1);
+    MatamazomResult result = shipOwnedOrders(matamazom, orderIds, n, results);
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || owned_ids[i] != owned_ids[i - 1]) {
+            disownOrder(matamazom, owned_ids[i]);
+        }
     }
+    unlockStructure(matamazom);
+    free(owned_ids);
+    return result;
+}
 
-    //update order iterator to point to current order for deletion
-    LIST_FOREACH(Order, searching_order, matamazom->orders) {
-        if (searching_order->order_id == current_order->order_id) {
-            break;
-        };
+/*
+ * Ships a batch of orders which the caller owns, wave by wave. The lines of
+ * the orders can't change, so the waves stay valid until they are shipped.
+ */
+static MatamazomResult shipOwnedOrders(Matamazom matamazom,
+                                       const unsigned int *orderIds, int n,
+                                       MatamazomResult *results) {
+    int *waves = malloc(sizeof(*waves) * n);
+    int waves_count = 0;
+    if (waves == NULL ||
+        !planShipWaves(matamazom, orderIds, n, waves, &waves_count)) {
+        free(waves);
+        return MATAMAZOM_OUT_OF_MEMORY;
+    }
+    struct ShipBatch_t batch;
+    batch.matamazom = matamazom;
+    batch.order_ids = orderIds;
+    batch.results = results;
+    batch.schedule = malloc(sizeof(*batch.schedule) * n);
+    int *wave_starts = calloc(waves_count + 1, sizeof(*wave_starts));
+    if (batch.schedule == NULL || wave_starts == NULL) {
+        free(batch.schedule);
+        free(wave_starts);
+        free(waves);
+        return MATAMAZOM_OUT_OF_MEMORY;
+    }
+    // the orders out of the waves, missing or without lines, conflict with
+    // nothing but their own duplicates, so they are shipped first in turn
+    for (int i = 0; i < n; i++) {
+        if (waves[i] < 0) {
+            results[i] = shipOrder(matamazom, orderIds[i]);
+        } else {
+            wave_starts[waves[i] + 1]++;
+        }
+    }
+    // a counting sort keeps the positions of each wave in increasing order
+    for (int wave = 0; wave < waves_count; wave++) {
+        wave_starts[wave + 1] += wave_starts[wave];
+    }
+    for (int i = 0; i < n; i++) {
+        if (waves[i] >= 0) {
+            batch.schedule[wave_starts[waves[i]]++] = i;
+        }
     }
-    listRemoveCurrent(matamazom->orders);
+    // placing moved each start to the end of its wave, which is the next start
+    for (int wave = waves_count; wave > 0; wave--) {
+        wave_starts[wave] = wave_starts[wave - 1];
+    }
+    wave_starts[0] = 0;
+    shipBatch(&batch, wave_starts, waves_count);
+    free(batch.schedule);
+    free(wave_starts);
+    free(waves);
     return MATAMAZOM_SUCCESS;
+}
 
+static int compareOrderIds(const void *id1, const void *id2) {
+    unsigned int first = *(const unsigned int *) id1;
+    unsigned int second = *(const unsigned int *) id2;
+    return (first > second) - (first < second);
 }
 
+
 MatamazomResult
 mtmCancelOrder(Matamazom matamazom, const unsigned int orderId) {
     if (matamazom == NULL) {
         return MATAMAZOM_NULL_ARGUMENT;
     }
-    Order current_order = findOrder(matamazom->orders, orderId);
+    lockOrder(matamazom, orderId);
+    MatamazomResult result = cancelOrder(matamazom, orderId);
+    unlockOrder(matamazom, orderId);
+    return result;
+}
+
+static MatamazomResult cancelOrder(Matamazom matamazom,
+                                   const unsigned int orderId) {
+    Order current_order = findOrder(matamazom, orderId);
     if (current_order == NULL) {
         return MATAMAZOM_ORDER_NOT_EXIST;
     }
-    //update order iterator to point to current order for deletion
-    LIST_FOREACH(Order, searching_order, matamazom->orders) {
-        if (searching_order->order_id == current_order->order_id) {
-            break;
-        }
-    }
-    listRemoveCurrent(matamazom->orders);
+    releaseOrder(matamazom, current_order);
+    removeOrder(matamazom, current_order);
     return MATAMAZOM_SUCCESS;
 }
 
+MatamazomResult mtmReserveOrder(Matamazom matamazom,
+                                const unsigned int orderId) {
+    if (matamazom == NULL) {
+        return MATAMAZOM_NULL_ARGUMENT;
+    }
+    Order order = lockOrder(matamazom, orderId);
+    MatamazomResult result = MATAMAZOM_ORDER_NOT_EXIST;
+    if (order != NULL) {
+        result = reserveOrder(matamazom, order);
+    }
+    unlockOrder(matamazom, orderId);
+    return result;
+}
+
 MatamazomResult mtmPrintInventory(Matamazom matamazom, FILE *output) {
     if (matamazom == NULL || output == NULL) {
         return MATAMAZOM_NULL_ARGUMENT;
     }
+    if (matamazom->locks == NULL) {
+        return printInventory(matamazom->storage, false, output);
+    }
+    // the report is printed from a snapshot, without holding any lock
+    MatamazomSnapshot snapshot = mtmSnapshotAcquire(matamazom);
+    if (snapshot == NULL) {
+        return MATAMAZOM_OUT_OF_MEMORY;
+    }
+    MatamazomResult result = printInventory(snapshot->products, true, output);
+    mtmSnapshotRelease(snapshot);
+    return result;
+}
+
+/*
+ * Prints products, whose amounts are their stock if stockInSet, as in a
+ * snapshot, and otherwise the stock not reserved, as in the storage.
+ */
+static MatamazomResult printInventory(AmountSet products, bool stockInSet,
+                                      FILE *output) {
     fprintf(output, "Inventory Status:\n");
-    if (matamazom->storage == NULL) {
+    if (products == NULL) {
         return MATAMAZOM_SUCCESS;
     }
-    AS_FOREACH(Product, product, matamazom->storage) {
-        double product_amount;
-        asGetAmount(matamazom->storage, product, &product_amount);
-        double product_price = product->prodPrice(product->customData,
-                                                  1);
+    ASIterator iterator;
+    AS_FOREACH_ITER(Product, product, iterator, products) {
+        double product_amount = stockInSet ? asIterAmount(&iterator)
+                                           : stockAmount(product);
+        double product_price = unitPrice(product);
         mtmPrintProductDetails(product->name, product->product_id,
                                product_amount, product_price, output);
     }
@@ -360,85 +997,206 @@ mtmPrintOrder(Matamazom matamazom, const unsigned int orderId, FILE *output) {
     if (matamazom == NULL || output == NULL) {
         return MATAMAZOM_NULL_ARGUMENT;
     }
-    Order curr_order = findOrder(matamazom->orders, orderId);
+    lockOrder(matamazom, orderId);
+    MatamazomResult result = printOrder(matamazom, orderId, output);
+    unlockOrder(matamazom, orderId);
+    return result;
+}
+
+static MatamazomResult printOrder(Matamazom matamazom,
+                                  const unsigned int orderId, FILE *output) {
+    Order curr_order = findOrder(matamazom, orderId);
     if (curr_order == NULL) {
         return MATAMAZOM_ORDER_NOT_EXIST;
     }
     double order_sum = 0;
     mtmPrintOrderHeading(curr_order->order_id, output);
-    AS_FOREACH(Product, product, curr_order->products_in_order) {
-        Product product_in_order = findProductInOrder(
-                curr_order->products_in_order, product->product_id);
-        double product_amount_in_order;
-        asGetAmount(curr_order->products_in_order, product,
-                    &product_amount_in_order);
-        double total_product_price = product_in_order->prodPrice(
-                product_in_order->customData, product_amount_in_order);
-        product_in_order->prodPrice(product_in_order->customData,
-                                    product_amount_in_order);
+    ASIterator line;
+    AS_FOREACH_ITER(Product, product, line, curr_order->products_in_order) {
+        double product_amount_in_order = asIterAmount(&line);
+        double total_product_price = productPrice(product,
+                                                  product_amount_in_order);
         mtmPrintProductDetails(product->name, product->product_id,
                                product_amount_in_order, total_product_price,
                                output);
         order_sum += total_product_price;
     }
     mtmPrintOrderSummary(order_sum, output);
+    curr_order->total = order_sum; // drops any rounding the edits accumulated
+    curr_order->total_valid = true;
     return MATAMAZOM_SUCCESS;
 }
 
+MatamazomResult mtmGetOrderTotal(Matamazom matamazom,
+                                 const unsigned int orderId,
+                                 double *outTotal) {
+    if (matamazom == NULL || outTotal == NULL) {
+        return MATAMAZOM_NULL_ARGUMENT;
+    }
+    Order order = lockOrder(matamazom, orderId);
+    MatamazomResult result = MATAMAZOM_ORDER_NOT_EXIST;
+    if (order != NULL) {
+        *outTotal = orderTotal(order);
+        result = MATAMAZOM_SUCCESS;
+    }
+    unlockOrder(matamazom, orderId);
+    return result;
+}
+
 MatamazomResult mtmPrintBestSelling(Matamazom matamazom, FILE *output) {
     if (matamazom == NULL || output == NULL) {
         return MATAMAZOM_NULL_ARGUMENT;
     }
-    fprintf(output, "Best Selling Product:\n");
-    double best_seller_sales = 0;
-    int best_seller_id = -1;
-    //find id of best seller
-    AS_FOREACH(Product, product, matamazom->storage) {
-        if (product->sales > best_seller_sales) {
-            best_seller_id = (int) product->product_id;
-            best_seller_sales = product->sales;
-            continue;
-        }
-        if (product->sales == best_seller_sales) {
-            best_seller_id = (best_seller_id < product->product_id)
-                             ? (int) best_seller_id : (int) product->product_id;
-        }
+    lockStructure(matamazom, false);
+    lockSales(matamazom);
+    MatamazomResult result = printBestSelling(matamazom, output);
+    unlockSales(matamazom);
+    unlockStructure(matamazom);
+    return result;
+}
+
+static MatamazomResult printBestSelling(Matamazom matamazom, FILE *output) {
+    if (!refreshBestSellers(matamazom)) {
+        return MATAMAZOM_OUT_OF_MEMORY;
     }
-    if (best_seller_sales == 0) {
+    fprintf(output, "Best Selling Product:\n");
+    ASIterator iterator;
+    Product best_seller_ptr = asIterBegin(matamazom->best_sellers, &iterator);
+    if (best_seller_ptr == NULL) {
         fprintf(output, "none\n");
         return MATAMAZOM_SUCCESS;
     }
-    Product best_seller_ptr = findProduct(matamazom->storage, best_seller_id);
     mtmPrintIncomeLine(best_seller_ptr->name, best_seller_ptr->product_id,
-                       best_seller_sales, output);
+                       best_seller_ptr->sales, output);
     return MATAMAZOM_SUCCESS;
 }
 
+int mtmGetTopSellers(Matamazom matamazom, int k, unsigned int *out) {
+    if (matamazom == NULL || out == NULL || k < 0) {
+        return -1;
+    }
+    lockStructure(matamazom, false);
+    lockSales(matamazom);
+    int count = getTopSellers(matamazom, k, out);
+    unlockSales(matamazom);
+    unlockStructure(matamazom);
+    return count;
+}
+
+static int getTopSellers(Matamazom matamazom, int k, unsigned int *out) {
+    if (!refreshBestSellers(matamazom)) {
+        return -1;
+    }
+    int count = 0;
+    ASIterator iterator;
+    for (Product product = asIterBegin(matamazom->best_sellers, &iterator);
+         product != NULL && count < k; product = asIterNext(&iterator)) {
+        out[count++] = product->product_id;
+    }
+    return count;
+}
+
 MatamazomResult
 mtmPrintFiltered(Matamazom matamazom, MtmFilterProduct customFilter,
                  FILE *output) {
     if (matamazom == NULL || customFilter == NULL || output == NULL) {
         return MATAMAZOM_NULL_ARGUMENT;
     }
+    if (matamazom->locks == NULL) {
+        return printFiltered(matamazom->storage, false, customFilter, output);
+    }
+    // customFilter is called on the snapshot's copies, without holding any lock
+    MatamazomSnapshot snapshot = mtmSnapshotAcquire(matamazom);
+    if (snapshot == NULL) {
+        return MATAMAZOM_OUT_OF_MEMORY;
+    }
+    MatamazomResult result = printFiltered(snapshot->products, true,
+                                           customFilter, output);
+    mtmSnapshotRelease(snapshot);
+    return result;
+}
 
-    AS_FOREACH(Product, curr_product, matamazom->storage) {
-        double product_amount;
-        asGetAmount(matamazom->storage, curr_product, &product_amount);
-        double product_price = (double) curr_product->prodPrice(
-                curr_product->customData,
-                product_amount / product_amount);
-        if (customFilter(curr_product->product_id, curr_product->name,
-                         product_amount, curr_product->customData)) {
-            mtmPrintProductDetails(curr_product->name, curr_product->product_id,
-                                   product_amount, product_price, output);
+MatamazomSnapshot mtmSnapshotAcquire(Matamazom matamazom) {
+    if (matamazom == NULL) {
+        return NULL;
+    }
+    // the shared lock keeps the products in place while they are copied,
+    // and other calls, even on the same products, go on meanwhile
+    lockStructure(matamazom, false);
+    MatamazomSnapshot snapshot = currentSnapshot(matamazom);
+    if (snapshot == NULL) {
+        snapshot = takeSnapshot(matamazom);
+        if (snapshot != NULL) {
+            publishSnapshot(matamazom, snapshot);
         }
     }
-    return MATAMAZOM_SUCCESS;
+    unlockStructure(matamazom);
+    return snapshot;
 }
 
-
-static bool nameIsValid(const char *name) {
-    if ((*name >= 'a' && *name <= 'z') || (*name >= 'A' && *name <= 'Z') ||
+void mtmSnapshotRelease(MatamazomSnapshot snapshot) {
+    if (snapshot == NULL) {
+        return;
+    }
+    SnapshotSegment unused[PRODUCT_LOCK_STRIPES];
+    int unused_count = 0;
+    lockSnapshots(snapshot->owner);
+    bool last_reference = --snapshot->references == 0;
+    for (int i = 0; last_reference && i < PRODUCT_LOCK_STRIPES; i++) {
+        SnapshotSegment segment = snapshot->segments[i];
+        if (segment != NULL && --segment->references == 0) {
+            unused[unused_count++] = segment;
+        }
+    }
+    unlockSnapshots(snapshot->owner);
+    if (last_reference) {
+        asDestroy(snapshot->products);
+        free(snapshot);
+    }
+    for (int i = 0; i < unused_count; i++) {
+        asDestroy(unused[i]->products);
+        free(unused[i]);
+    }
+}
+
+MatamazomResult mtmSnapshotPrintInventory(MatamazomSnapshot snapshot,
+                                          FILE *output) {
+    if (snapshot == NULL || output == NULL) {
+        return MATAMAZOM_NULL_ARGUMENT;
+    }
+    return printInventory(snapshot->products, true, output);
+}
+
+MatamazomResult mtmSnapshotPrintFiltered(MatamazomSnapshot snapshot,
+                                         MtmFilterProduct customFilter,
+                                         FILE *output) {
+    if (snapshot == NULL || customFilter == NULL || output == NULL) {
+        return MATAMAZOM_NULL_ARGUMENT;
+    }
+    return printFiltered(snapshot->products, true, customFilter, output);
+}
+
+/* @see printInventory */
+static MatamazomResult printFiltered(AmountSet products, bool stockInSet,
+                                     MtmFilterProduct customFilter,
+                                     FILE *output) {
+    ASIterator iterator;
+    AS_FOREACH_ITER(Product, curr_product, iterator, products) {
+        double product_amount = stockInSet ? asIterAmount(&iterator)
+                                           : stockAmount(curr_product);
+        double product_price = unitPrice(curr_product);
+        if (customFilter(curr_product->product_id, curr_product->name,
+                         product_amount, curr_product->customData)) {
+            mtmPrintProductDetails(curr_product->name, curr_product->product_id,
+                                   product_amount, product_price, output);
+        }
+    }
+    return MATAMAZOM_SUCCESS;
+}
+
+
+static bool nameIsValid(const char *name) {
+    if ((*name >= 'a' && *name <= 'z') || (*name >= 'A' && *name <= 'Z') ||
         (*name >= '0' && *name <= '9')) {
         return true;
     }
@@ -448,30 +1206,93 @@ static bool nameIsValid(const char *name) {
 
 
 static bool checkAmountType(double amount, MatamazomAmountType type) {
-    bool result;
-    double floored = floor(amount);
+    if (!asAmountInRange(amount, AMOUNT_SCALE)) {
+        return false; // too large to be kept, or not a number
+    }
+    if (amount != 0 && toUnits(amount) == 0) {
+        return false; // smaller than a unit, so it would be lost
+    }
+    int64_t quantum;
     switch (type) {
         case MATAMAZOM_INTEGER_AMOUNT:
-            if ((amount - floored > 0.001) && (amount - floored < 0.999)) {
-                result = false;
-                break;
-            }
+            quantum = INTEGER_QUANTUM;
+            break;
         case MATAMAZOM_HALF_INTEGER_AMOUNT:
-            if ((amount - floored > 0.001 && amount - floored < 0.499) ||
-                (amount - floored > 0.501 && amount - floored < 0.999)) {
-                result = false;
-                break;
-            }
+            quantum = HALF_INTEGER_QUANTUM;
+            break;
         default:
-            result = true;
+            quantum = ANY_AMOUNT_QUANTUM;
     }
-    return result;
+    int64_t remainder = toUnits(amount) % quantum;
+    if (remainder < 0) {
+        remainder += quantum;
+    }
+    return remainder <= AMOUNT_TOLERANCE || quantum - remainder <= AMOUNT_TOLERANCE;
+}
+
+/*
+ * Converts amount to the integer units the amount sets keep it in. amount must
+ * be in range (@see checkAmountType).
+ */
+static int64_t toUnits(double amount) {
+    double scaled = amount * AMOUNT_SCALE;
+    return (int64_t) (scaled + ((scaled < 0) ? -0.5 : 0.5));
+}
+
+/*
+ * Reserving an order takes the amounts of its lines out of the storage, which
+ * holds the stock not reserved: they are not available to other orders or to
+ * mtmChangeProductAmount until the order is shipped, cancelled or edited, and
+ * the stock of the products does not change. The storage's counters never go
+ * negative, so taking a line's amount fails if the storage does not hold
+ * enough of it; the lines taken before it are then put back, so either all of
+ * them are held or none is.
+ */
+
+static MatamazomResult reserveOrder(Matamazom matamazom, Order order) {
+    if (order->reserved) {
+        return MATAMAZOM_SUCCESS;
+    }
+    ASIterator line;
+    AS_FOREACH_ITER(Product, product, line, order->products_in_order) {
+        if (asHandleChangeAmount(matamazom->storage,
+                                 findProductHandle(matamazom,
+                                                   product->product_id),
+                                 -asIterAmount(&line)) != AS_SUCCESS) {
+            ASIterator taken;
+            for (Product taken_product = asIterBegin(order->products_in_order,
+                                                     &taken);
+                 taken_product != product; taken_product = asIterNext(&taken)) {
+                asHandleChangeAmount(matamazom->storage,
+                                     findProductHandle(
+                                             matamazom,
+                                             taken_product->product_id),
+                                     asIterAmount(&taken));
+            }
+            return MATAMAZOM_INSUFFICIENT_AMOUNT;
+        }
+    }
+    order->reserved = true;
+    return MATAMAZOM_SUCCESS;
+}
+
+static void releaseOrder(Matamazom matamazom, Order order) {
+    if (!order->reserved) {
+        return;
+    }
+    ASIterator line;
+    AS_FOREACH_ITER(Product, product, line, order->products_in_order) {
+        asHandleChangeAmount(matamazom->storage,
+                             findProductHandle(matamazom, product->product_id),
+                             asIterAmount(&line));
+    }
+    order->reserved = false;
 }
 
 static void freeProduct(ASElement product) {
     Product prod_to_delete = product;
-    free(prod_to_delete->name);
     prod_to_delete->freeData(prod_to_delete->customData);
+    free(prod_to_delete->order_ids);
     free(prod_to_delete);
 }
 
@@ -481,80 +1302,1096 @@ static int compareProduct(ASElement product1, ASElement product2) {
     return (int) (prod1->product_id) - (int) (prod2->product_id);
 }
 
+static unsigned int hashProduct(ASElement product) {
+    return hashProductId(((Product) product)->product_id);
+}
+
 static ASElement copyProduct(ASElement product) {
     Product copy = malloc(sizeof(*copy));
     Product prod_to_be_copied = product;
     if (copy != NULL) {
         copy->product_id = prod_to_be_copied->product_id;
-        int str_len = strlen(prod_to_be_copied->name);
-        char *name = malloc(sizeof(char) * str_len + 1);
-        if (name == NULL) {
-            return NULL;
-        }
-        strcpy(name, prod_to_be_copied->name);
-        copy->name = name;
+        copy->name = prod_to_be_copied->name; // interned, shared by all copies
         copy->amountType = prod_to_be_copied->amountType;
         copy->prodPrice = prod_to_be_copied->prodPrice;
-        copy->sales = prod_to_be_copied->sales;
+        copy->linear_price = prod_to_be_copied->linear_price;
+        copy->unit_price_valid = __atomic_load_n(
+                &prod_to_be_copied->unit_price_valid, __ATOMIC_ACQUIRE);
+        __atomic_load(&prod_to_be_copied->unit_price, &copy->unit_price,
+                      __ATOMIC_RELAXED);
+        copy->stock = __atomic_load_n(&prod_to_be_copied->stock,
+                                      __ATOMIC_RELAXED);
+        __atomic_load(&prod_to_be_copied->sales, &copy->sales,
+                      __ATOMIC_RELAXED);
         copy->copyData = prod_to_be_copied->copyData;
         copy->freeData = prod_to_be_copied->freeData;
         copy->customData = prod_to_be_copied->copyData(
                 prod_to_be_copied->customData);
+        // a copy is a new product, no order has a line of it yet
+        copy->order_ids = NULL;
+        copy->orders_count = 0;
+        copy->orders_capacity = 0;
     }
     return copy;
 }
 
-static ListElement copyOrder(ListElement order) {
-    Order order_copy = order;
-    Order copy = malloc(sizeof(*copy));
-    if (copy == NULL) {
-        return copy;
+/* A line refers to the product in the storage, so it has nothing to copy */
+static ASElement copyLine(ASElement product) {
+    return product;
+}
+
+/* The product of a line belongs to the storage */
+static void freeLine(ASElement product) {
+    (void) product;
+}
+
+static void freeOrder(Order order) {
+    if (order != NULL) {
+        asDestroy(order->products_in_order);
     }
-    copy->order_id = order_copy->order_id;
-    copy->products_in_order = asCopy(order_copy->products_in_order);
-    return copy;
+    free(order);
+}
+
+/*
+ * Order ids are given in increasing order, so the open orders are kept in a
+ * table indexed by id. orders_base is the id of the first slot; when the
+ * table is full, the slots of the oldest orders which were already shipped
+ * or cancelled are dropped from its start before it is grown.
+ */
+
+static Order findOrder(Matamazom matamazom, unsigned int orderId) {
+    lockOrders(matamazom);
+    Order order = orderSlot(matamazom, orderId);
+    unlockOrders(matamazom);
+    return order;
+}
+
+/* Returns the order in the slot of orderId. The table must be locked */
+static Order orderSlot(Matamazom matamazom, unsigned int orderId) {
+    if (orderId < matamazom->orders_base ||
+        orderId - matamazom->orders_base >=
+        (unsigned int) matamazom->orders_capacity) {
+        return NULL;
+    }
+    return matamazom->orders[orderId - matamazom->orders_base];
+}
+
+/* Makes room for the slot of orderId, the id after all the given ids */
+static bool reserveOrderSlot(Matamazom matamazom, unsigned int orderId) {
+    if (orderId - matamazom->orders_base <
+        (unsigned int) matamazom->orders_capacity) {
+        return true;
+    }
+    int closed = 0;
+    unsigned int used = orderId - matamazom->orders_base;
+    while (closed < (int) used && matamazom->orders[closed] == NULL) {
+        closed++;
+    }
+    if (closed > 0) {
+        memmove(matamazom->orders, matamazom->orders + closed,
+                sizeof(*matamazom->orders) * (used - closed));
+        for (int i = (int) used - closed; i < (int) used; i++) {
+            matamazom->orders[i] = NULL;
+        }
+        matamazom->orders_base += closed;
+    }
+    // grow unless at least a quarter of the table was freed
+    if (closed * 4 >= matamazom->orders_capacity && closed > 0) {
+        return true;
+    }
+    int new_capacity = (matamazom->orders_capacity == 0)
+                       ? ORDER_SLOTS_INITIAL_CAPACITY
+                       : matamazom->orders_capacity * 2;
+    Order *new_orders = realloc(matamazom->orders,
+                                sizeof(*new_orders) * new_capacity);
+    if (new_orders == NULL) {
+        return false;
+    }
+    for (int i = matamazom->orders_capacity; i < new_capacity; i++) {
+        new_orders[i] = NULL;
+    }
+    matamazom->orders = new_orders;
+    matamazom->orders_capacity = new_capacity;
+    return true;
+}
+
+static void removeOrder(Matamazom matamazom, Order order) {
+    assert(findOrder(matamazom, order->order_id) == order);
+    lockOrders(matamazom);
+    matamazom->orders[order->order_id - matamazom->orders_base] = NULL;
+    unlockOrders(matamazom);
+    freeOrder(order);
+}
+
+/*
+ * Every product keeps the ids of the open orders with a line of it. A line
+ * deleted from an order removes the order from its product's list right
+ * away. A shipped or cancelled order is not searched for in the lists of all
+ * its products: since ids are never given again it is simply not found any
+ * more, and such ids are dropped when the list would otherwise grow.
+ */
+
+static bool addProductOrder(Matamazom matamazom, Product product,
+                            unsigned int orderId) {
+    ProductStripes stripes = lockProducts(matamazom,
+                                          productStripe(product->product_id));
+    if (product->orders_count == product->orders_capacity) {
+        int open_orders = 0;
+        for (int i = 0; i < product->orders_count; i++) {
+            if (findOrder(matamazom, product->order_ids[i]) != NULL) {
+                product->order_ids[open_orders++] = product->order_ids[i];
+            }
+        }
+        product->orders_count = open_orders;
+    }
+    if (product->orders_count == product->orders_capacity) {
+        int new_capacity = (product->orders_capacity == 0)
+                           ? PRODUCT_ORDERS_INITIAL_CAPACITY
+                           : product->orders_capacity * 2;
+        unsigned int *new_ids = realloc(product->order_ids,
+                                        sizeof(*new_ids) * new_capacity);
+        if (new_ids == NULL) {
+            unlockProducts(matamazom, stripes);
+            return false;
+        }
+        product->order_ids = new_ids;
+        product->orders_capacity = new_capacity;
+    }
+    product->order_ids[product->orders_count++] = orderId;
+    unlockProducts(matamazom, stripes);
+    return true;
+}
+
+/*
+ * Returns the price of one unit of product, calling prodPrice only once. The
+ * cache is read and filled with atomic loads and stores, so threads share it
+ * without a lock; threads which miss it together all store the same price.
+ */
+static double unitPrice(Product product) {
+    double price;
+    if (__atomic_load_n(&product->unit_price_valid, __ATOMIC_ACQUIRE)) {
+        __atomic_load(&product->unit_price, &price, __ATOMIC_RELAXED);
+        return price;
+    }
+    price = product->prodPrice(product->customData, 1);
+    __atomic_store(&product->unit_price, &price, __ATOMIC_RELAXED);
+    __atomic_store_n(&product->unit_price_valid, true, __ATOMIC_RELEASE);
+    return price;
+}
+
+static double productPrice(Product product, double amount) {
+    if (product->linear_price) {
+        return unitPrice(product) * amount;
+    }
+    return product->prodPrice(product->customData, amount);
+}
+
+/* The stock of a product, which its amount in the storage leaves out */
+static double stockAmount(Product product) {
+    return (double) __atomic_load_n(&product->stock, __ATOMIC_RELAXED) /
+           AMOUNT_SCALE;
+}
+
+/* The price of a line of an order, 0 for no line */
+static double linePrice(Product product, double amount) {
+    if (amount == 0) {
+        return 0;
+    }
+    return productPrice(product, amount);
+}
+
+/* Returns the total of order, computing it again only if it was invalidated */
+static double orderTotal(Order order) {
+    if (!order->total_valid) {
+        order->total = 0;
+        ASIterator line;
+        AS_FOREACH_ITER(Product, product, line, order->products_in_order) {
+            order->total += productPrice(product, asIterAmount(&line));
+        }
+        order->total_valid = true;
+    }
+    return order->total;
 }
 
-static void freeOrder(ListElement order) {
-    Order order_to_delete = order;
-    if (order_to_delete != NULL) {
-        asDestroy(order_to_delete->products_in_order);
+/*
+ * The best sellers are an ordered set of the products with positive sales,
+ * by sales from high to low and by id on equal sales. A product's position
+ * depends on its sales, so it leaves the set before they change.
+ */
+
+static int compareSales(ASElement product1, ASElement product2) {
+    Product prod1 = product1;
+    Product prod2 = product2;
+    if (prod1->sales != prod2->sales) {
+        return (prod1->sales > prod2->sales) ? -1 : 1;
+    }
+    if (prod1->product_id != prod2->product_id) {
+        return (prod1->product_id < prod2->product_id) ? -1 : 1;
+    }
+    return 0;
+}
+
+static void addSales(Matamazom matamazom, Product product, double sales) {
+    lockSales(matamazom);
+    if (matamazom->best_sellers != NULL && product->sales > 0) {
+        asDelete(matamazom->best_sellers, product);
+    }
+    // snapshots copy the sales without the lock
+    double new_sales = product->sales + sales;
+    __atomic_store(&product->sales, &new_sales, __ATOMIC_RELAXED);
+    if (!matamazom->best_sellers_stale && product->sales > 0) {
+        if (matamazom->best_sellers == NULL) {
+            matamazom->best_sellers = asCreateOrdered(copyLine, freeLine,
+                                                      compareSales);
+        }
+        // the sales themselves are correct, the set is rebuilt when next read
+        if (matamazom->best_sellers == NULL ||
+            asRegister(matamazom->best_sellers, product) != AS_SUCCESS) {
+            matamazom->best_sellers_stale = true;
+        }
+    }
+    unlockSales(matamazom);
+}
+
+/* Makes sure the best sellers exist and match the sales of the products */
+static bool refreshBestSellers(Matamazom matamazom) {
+    if (matamazom->best_sellers == NULL) {
+        matamazom->best_sellers = asCreateOrdered(copyLine, freeLine,
+                                                  compareSales);
+        if (matamazom->best_sellers == NULL) {
+            return false;
+        }
+    }
+    if (!matamazom->best_sellers_stale) {
+        return true;
+    }
+    asClear(matamazom->best_sellers);
+    ASIterator iterator;
+    AS_FOREACH_ITER(Product, product, iterator, matamazom->storage) {
+        if (product->sales > 0 &&
+            asRegister(matamazom->best_sellers, product) != AS_SUCCESS) {
+            return false;
+        }
     }
-    free(order_to_delete);
+    matamazom->best_sellers_stale = false;
+    return true;
 }
 
-static Order findOrder(List orders, unsigned int orderId) {
-    if (orders == NULL) {
+static void removeProductOrder(Matamazom matamazom, Product product,
+                               unsigned int orderId) {
+    ProductStripes stripes = lockProducts(matamazom,
+                                          productStripe(product->product_id));
+    for (int i = 0; i < product->orders_count; i++) {
+        if (product->order_ids[i] == orderId) {
+            product->order_ids[i] = product->order_ids[--product->orders_count];
+            break;
+        }
+    }
+    unlockProducts(matamazom, stripes);
+}
+
+static Product findProduct(Matamazom matamazom, const unsigned int id) {
+    ASHandle handle = findProductHandle(matamazom, id);
+    if (handle == NULL) {
         return NULL;
     }
-    LIST_FOREACH(Order, tmp_product, orders) {
-        if (tmp_product->order_id == orderId) {
-            return tmp_product;
+    return asHandleGetElement(matamazom->storage, handle);
+}
+
+/*
+ * The product index maps ids to handles into the storage, so a product is
+ * found without searching the storage or building a key product. It is an
+ * open addressing table with linear probing, at most half full, like the
+ * index of a hashed amount set.
+ */
+
+static unsigned int hashProductId(unsigned int id) {
+    // every bit of the id reaches the low bits kept by the tables and the
+    // stripes (MurmurHash3's finalizer), so strided ids spread as well
+    uint32_t hash = id;
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6Bu;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static ASHandle findProductHandle(Matamazom matamazom, const unsigned int id) {
+    if (matamazom->product_index == NULL) {
+        return NULL;
+    }
+    unsigned int mask = matamazom->product_index_capacity - 1;
+    unsigned int position = hashProductId(id) & mask;
+    while (matamazom->product_index[position].handle != NULL) {
+        if (matamazom->product_index[position].product_id == id) {
+            return matamazom->product_index[position].handle;
         }
+        position = (position + 1) & mask;
     }
     return NULL;
 }
 
-static Product findProduct(AmountSet storage, const unsigned int id) {
-    if (storage == NULL) {
+static bool productIndexReserve(Matamazom matamazom, int needed_size) {
+    if (needed_size * 2 <= matamazom->product_index_capacity) {
+        return true;
+    }
+    int new_capacity = (matamazom->product_index_capacity == 0)
+                       ? PRODUCT_INDEX_INITIAL_CAPACITY
+                       : matamazom->product_index_capacity;
+    while (needed_size * 2 > new_capacity) {
+        new_capacity *= 2;
+    }
+    ProductSlot *new_index = calloc(new_capacity, sizeof(*new_index));
+    if (new_index == NULL) {
+        return false;
+    }
+    ProductSlot *old_index = matamazom->product_index;
+    int old_capacity = matamazom->product_index_capacity;
+    matamazom->product_index = new_index;
+    matamazom->product_index_capacity = new_capacity;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_index[i].handle != NULL) {
+            productIndexInsert(matamazom, old_index[i].product_id,
+                               old_index[i].handle);
+        }
+    }
+    free(old_index);
+    return true;
+}
+
+static void productIndexInsert(Matamazom matamazom, unsigned int id,
+                               ASHandle handle) {
+    assert(matamazom->product_index != NULL);
+    unsigned int mask = matamazom->product_index_capacity - 1;
+    unsigned int position = hashProductId(id) & mask;
+    while (matamazom->product_index[position].handle != NULL) {
+        position = (position + 1) & mask;
+    }
+    matamazom->product_index[position].product_id = id;
+    matamazom->product_index[position].handle = handle;
+}
+
+static void productIndexRemove(Matamazom matamazom, unsigned int id) {
+    ProductSlot *index = matamazom->product_index;
+    unsigned int mask = matamazom->product_index_capacity - 1;
+    unsigned int position = hashProductId(id) & mask;
+    while (index[position].handle == NULL ||
+           index[position].product_id != id) {
+        position = (position + 1) & mask;
+    }
+    // shift back the following entries instead of leaving a tombstone
+    unsigned int hole = position;
+    position = (position + 1) & mask;
+    while (index[position].handle != NULL) {
+        unsigned int home = hashProductId(index[position].product_id) & mask;
+        if (((position - home) & mask) >= ((position - hole) & mask)) {
+            index[hole] = index[position];
+            hole = position;
+        }
+        position = (position + 1) & mask;
+    }
+    index[hole].handle = NULL;
+}
+
+
+
+
+/*
+ * Product names are interned: each distinct name is stored once in the name
+ * arena of the Matamazom and every product with that name, in the storage or
+ * in an order, points at it. The arena is a list of chunks which are only
+ * freed by matamazomDestroy. The name index is an open addressing table of
+ * the names in the arena, used to find a name which was already interned.
+ */
+
+static const char *internName(Matamazom matamazom, const char *name) {
+    if (!nameIndexReserve(matamazom, matamazom->names_count + 1)) {
         return NULL;
     }
-    AS_FOREACH(Product, tmp_order, storage) {
-        if (tmp_order->product_id == id) {
-            return tmp_order;
+    unsigned int mask = matamazom->name_index_capacity - 1;
+    unsigned int position = hashName(name) & mask;
+    while (matamazom->name_index[position] != NULL) {
+        if (strcmp(matamazom->name_index[position], name) == 0) {
+            return matamazom->name_index[position];
         }
+        position = (position + 1) & mask;
     }
-    return NULL;
+    size_t size = strlen(name) + 1;
+    char *interned_name = allocateName(matamazom, size);
+    if (interned_name == NULL) {
+        return NULL;
+    }
+    memcpy(interned_name, name, size);
+    matamazom->name_index[position] = interned_name;
+    matamazom->names_count++;
+    return interned_name;
+}
+
+static char *allocateName(Matamazom matamazom, size_t size) {
+    NameChunk chunk = matamazom->name_chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = (size > NAME_CHUNK_SIZE) ? size : NAME_CHUNK_SIZE;
+        chunk = malloc(sizeof(*chunk) + chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        chunk->next = matamazom->name_chunks;
+        matamazom->name_chunks = chunk;
+    }
+    char *name = chunk->names + chunk->used;
+    chunk->used += size;
+    return name;
+}
+
+static bool nameIndexReserve(Matamazom matamazom, int needed_size) {
+    if (needed_size * 2 <= matamazom->name_index_capacity) {
+        return true;
+    }
+    int new_capacity = (matamazom->name_index_capacity == 0)
+                       ? NAME_INDEX_INITIAL_CAPACITY
+                       : matamazom->name_index_capacity;
+    while (needed_size * 2 > new_capacity) {
+        new_capacity *= 2;
+    }
+    const char **new_index = calloc(new_capacity, sizeof(*new_index));
+    if (new_index == NULL) {
+        return false;
+    }
+    const char **old_index = matamazom->name_index;
+    int old_capacity = matamazom->name_index_capacity;
+    matamazom->name_index = new_index;
+    matamazom->name_index_capacity = new_capacity;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_index[i] != NULL) {
+            nameIndexInsert(matamazom, old_index[i]);
+        }
+    }
+    free(old_index);
+    return true;
+}
+
+static void nameIndexInsert(Matamazom matamazom, const char *name) {
+    unsigned int mask = matamazom->name_index_capacity - 1;
+    unsigned int position = hashName(name) & mask;
+    while (matamazom->name_index[position] != NULL) {
+        position = (position + 1) & mask;
+    }
+    matamazom->name_index[position] = name;
+}
+
+static unsigned int hashName(const char *name) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * mtmShipOrders ships a batch in waves. An order's wave is the one after the
+ * last wave of an earlier order of the batch with a common product, so the
+ * orders of a wave have no common product and can be shipped at once, while
+ * the orders of each product are shipped in the order of the batch. Each
+ * order then sees the products exactly as if the batch were shipped in turn.
+ */
+
+/*
+ * Sets the wave of every order of the batch, or -1 for an order which does
+ * not exist or has no lines, and the number of waves. Returns false if an
+ * allocation failed.
+ */
+static bool planShipWaves(Matamazom matamazom, const unsigned int *orderIds,
+                          int n, int *waves, int *outWavesCount) {
+    // the amount of each product is one more than the last wave it is in
+    ASOptions options = {AS_BACKEND_SKIP_LIST, hashProduct, NULL, 0};
+    AmountSet last_waves = asCreateWithOptions(copyLine, freeLine,
+                                               compareProduct, &options);
+    if (last_waves == NULL) {
+        return false;
+    }
+    int waves_count = 0;
+    for (int i = 0; i < n; i++) {
+        Order order = findOrder(matamazom, orderIds[i]);
+        waves[i] = -1;
+        if (order == NULL || asGetSize(order->products_in_order) <= 0) {
+            continue;
+        }
+        int wave = 0;
+        ASIterator line;
+        AS_FOREACH_ITER(Product, product, line, order->products_in_order) {
+            ASHandle last_wave = NULL;
+            if (asFindOrRegister(last_waves, product, &last_wave) ==
+                AS_OUT_OF_MEMORY) {
+                asDestroy(last_waves);
+                return false;
+            }
+            double next_wave = 0;
+            asHandleGetAmount(last_waves, last_wave, &next_wave);
+            if ((int) next_wave > wave) {
+                wave = (int) next_wave;
+            }
+        }
+        AS_FOREACH_ITER(Product, product, line, order->products_in_order) {
+            ASHandle last_wave = asFind(last_waves, product);
+            double next_wave = 0;
+            asHandleGetAmount(last_waves, last_wave, &next_wave);
+            asHandleChangeAmount(last_waves, last_wave, wave + 1 - next_wave);
+        }
+        waves[i] = wave;
+        if (wave + 1 > waves_count) {
+            waves_count = wave + 1;
+        }
+    }
+    asDestroy(last_waves);
+    *outWavesCount = waves_count;
+    return true;
 }
 
-static Product
-findProductInOrder(AmountSet products_in_order, unsigned int productId) {
-    AS_FOREACH(Product, tmp_product, products_in_order) {
-        if (tmp_product->product_id == productId) {
-            return tmp_product;
+/*
+ * Ships the waves in turn. A wave big enough is shared with worker threads,
+ * which live as long as the batch; if none can be started, the calling
+ * thread ships every wave alone.
+ */
+static void shipBatch(ShipBatch batch, const int *waveStarts, int wavesCount) {
+    pthread_t workers[SHIP_WORKERS_MAX - 1];
+    int workers_count = 0;
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted_workers = (processors > SHIP_WORKERS_MAX)
+                         ? SHIP_WORKERS_MAX - 1 : (int) processors - 1;
+    batch->wave_number = 0;
+    batch->busy_workers = 0;
+    batch->finished = false;
+    bool has_big_wave = false;
+    for (int wave = 0; wave < wavesCount; wave++) {
+        if (waveStarts[wave + 1] - waveStarts[wave] >= SHIP_PARALLEL_MIN_WAVE) {
+            has_big_wave = true;
+        }
+    }
+    if (has_big_wave && wanted_workers > 0 && initShipBatchLocks(batch)) {
+        while (workers_count < wanted_workers &&
+               pthread_create(&workers[workers_count], NULL, shipWorker,
+                              batch) == 0) {
+            workers_count++;
+        }
+        if (workers_count == 0) {
+            destroyShipBatchLocks(batch);
+        }
+    }
+    for (int wave = 0; wave < wavesCount; wave++) {
+        batch->wave_begin = waveStarts[wave];
+        batch->wave_end = waveStarts[wave + 1];
+        batch->next = batch->wave_begin;
+        if (workers_count == 0 ||
+            batch->wave_end - batch->wave_begin < SHIP_PARALLEL_MIN_WAVE) {
+            shipWave(batch);
+            continue;
+        }
+        pthread_mutex_lock(&batch->mutex);
+        batch->busy_workers = workers_count;
+        batch->wave_number++;
+        pthread_cond_broadcast(&batch->wave_ready);
+        pthread_mutex_unlock(&batch->mutex);
+        shipWave(batch);
+        pthread_mutex_lock(&batch->mutex);
+        while (batch->busy_workers > 0) {
+            pthread_cond_wait(&batch->wave_done, &batch->mutex);
         }
+        pthread_mutex_unlock(&batch->mutex);
     }
+    if (workers_count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&batch->mutex);
+    batch->finished = true;
+    pthread_cond_broadcast(&batch->wave_ready);
+    pthread_mutex_unlock(&batch->mutex);
+    for (int i = 0; i < workers_count; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    destroyShipBatchLocks(batch);
+}
+
+static bool initShipBatchLocks(ShipBatch batch) {
+    if (pthread_mutex_init(&batch->mutex, NULL) != 0) {
+        return false;
+    }
+    if (pthread_cond_init(&batch->wave_ready, NULL) != 0) {
+        pthread_mutex_destroy(&batch->mutex);
+        return false;
+    }
+    if (pthread_cond_init(&batch->wave_done, NULL) != 0) {
+        pthread_cond_destroy(&batch->wave_ready);
+        pthread_mutex_destroy(&batch->mutex);
+        return false;
+    }
+    return true;
+}
+
+static void destroyShipBatchLocks(ShipBatch batch) {
+    pthread_cond_destroy(&batch->wave_done);
+    pthread_cond_destroy(&batch->wave_ready);
+    pthread_mutex_destroy(&batch->mutex);
+}
+
+static void *shipWorker(void *batch_ptr) {
+    ShipBatch batch = batch_ptr;
+    unsigned long shipped_wave = 0;
+    pthread_mutex_lock(&batch->mutex);
+    while (true) {
+        while (!batch->finished && batch->wave_number == shipped_wave) {
+            pthread_cond_wait(&batch->wave_ready, &batch->mutex);
+        }
+        if (batch->finished) {
+            break;
+        }
+        shipped_wave = batch->wave_number;
+        pthread_mutex_unlock(&batch->mutex);
+        shipWave(batch);
+        pthread_mutex_lock(&batch->mutex);
+        if (--batch->busy_workers == 0) {
+            pthread_cond_signal(&batch->wave_done);
+        }
+    }
+    pthread_mutex_unlock(&batch->mutex);
     return NULL;
 }
 
+/* Ships orders of the current wave until none is left to take */
+static void shipWave(ShipBatch batch) {
+    int i;
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) <
+           batch->wave_end) {
+        int position = batch->schedule[i];
+        batch->results[position] = shipOrder(batch->matamazom,
+                                             batch->order_ids[position]);
+    }
+}
+
+/*
+ * Takes a new snapshot with a single reference, for the Matamazom. The
+ * segments of the latest snapshot whose stripes did not change are shared,
+ * and only the products of the other stripes are copied. The copies don't
+ * hold the stock, which is read for the whole storage at once when they are
+ * listed. The structure must be locked.
+ */
+static MatamazomSnapshot takeSnapshot(Matamazom matamazom) {
+    MatamazomSnapshot snapshot = malloc(sizeof(*snapshot));
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    snapshot->owner = matamazom;
+    snapshot->products = NULL;
+    snapshot->references = 1;
+    unsigned long epochs[PRODUCT_LOCK_STRIPES];
+    for (int i = 0; i < PRODUCT_LOCK_STRIPES; i++) {
+        epochs[i] = __atomic_load_n(&matamazom->storage_epochs[i],
+                                    __ATOMIC_ACQUIRE);
+    }
+    bool copied[PRODUCT_LOCK_STRIPES];
+    bool success = true;
+    lockSnapshots(matamazom);
+    MatamazomSnapshot latest = matamazom->snapshot;
+    for (int i = 0; i < PRODUCT_LOCK_STRIPES; i++) {
+        snapshot->segments[i] = NULL;
+        copied[i] = latest == NULL || latest->segments[i]->epoch != epochs[i];
+        if (!copied[i]) {
+            snapshot->segments[i] = latest->segments[i];
+            snapshot->segments[i]->references++;
+        }
+    }
+    unlockSnapshots(matamazom);
+    for (int i = 0; success && i < PRODUCT_LOCK_STRIPES; i++) {
+        if (copied[i]) {
+            snapshot->segments[i] = newSegment(epochs[i]);
+            success = snapshot->segments[i] != NULL;
+        }
+    }
+    // the storage is ordered by id, so every segment is appended to in order
+    ASIterator iterator;
+    AS_FOREACH_ITER(Product, product, iterator, matamazom->storage) {
+        int stripe = productStripeIndex(product->product_id);
+        if (success && copied[stripe]) {
+            success = asRegister(snapshot->segments[stripe]->products,
+                                 product) == AS_SUCCESS;
+        }
+    }
+    // readers share the segments, so they must not fill the price caches
+    for (int i = 0; success && i < PRODUCT_LOCK_STRIPES; i++) {
+        if (copied[i]) {
+            AS_FOREACH_ITER(Product, product, iterator,
+                            snapshot->segments[i]->products) {
+                unitPrice(product);
+            }
+        }
+    }
+    if (!success || !listSnapshotProducts(matamazom, snapshot)) {
+        mtmSnapshotRelease(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+/* A new segment without products, with a single reference */
+static SnapshotSegment newSegment(unsigned long epoch) {
+    SnapshotSegment segment = malloc(sizeof(*segment));
+    if (segment == NULL) {
+        return NULL;
+    }
+    ASOptions segment_options = {AS_BACKEND_FLAT};
+    segment->products = asCreateWithOptions(copyProduct, freeProduct,
+                                            compareProduct, &segment_options);
+    if (segment->products == NULL) {
+        free(segment);
+        return NULL;
+    }
+    segment->epoch = epoch;
+    segment->references = 1;
+    return segment;
+}
+
+/*
+ * Lists the copies of all the segments of snapshot by id in its products,
+ * with the stock of the Matamazom's products as their amounts.
+ */
+static bool listSnapshotProducts(Matamazom matamazom,
+                                 MatamazomSnapshot snapshot) {
+    int count = (matamazom->storage == NULL) ? 0
+                                             : asGetSize(matamazom->storage);
+    ASElement *copies = malloc(sizeof(*copies) * (count + 1));
+    double *amounts = malloc(sizeof(*amounts) * (count + 1));
+    int64_t *stock = malloc(sizeof(*stock) * (count + 1));
+    ASOptions list_options = {AS_BACKEND_FLAT, NULL, NULL, AMOUNT_SCALE};
+    snapshot->products = asCreateWithOptions(copyLine, freeLine,
+                                             compareProduct, &list_options);
+    bool success = copies != NULL && amounts != NULL && stock != NULL &&
+                   snapshot->products != NULL;
+    if (success) {
+        snapshot->stock_version = readStock(matamazom, stock);
+        // every segment holds the copies of its stripe in the storage's order
+        ASIterator segments[PRODUCT_LOCK_STRIPES];
+        for (int i = 0; i < PRODUCT_LOCK_STRIPES; i++) {
+            asIterBegin(snapshot->segments[i]->products, &segments[i]);
+        }
+        int position = 0;
+        ASIterator iterator;
+        AS_FOREACH_ITER(Product, product, iterator, matamazom->storage) {
+            ASIterator *segment = &segments[productStripeIndex(
+                    product->product_id)];
+            copies[position] = asIterElement(segment);
+            amounts[position] = (double) stock[position] / AMOUNT_SCALE;
+            asIterNext(segment);
+            position++;
+        }
+        success = asRegisterBatch(snapshot->products, copies, amounts, count,
+                                  NULL) == AS_SUCCESS;
+    }
+    free(copies);
+    free(amounts);
+    free(stock);
+    return success;
+}
+
+/*
+ * Reads the stock of the products of the storage into stock, in the
+ * storage's order, as it was at a single moment: the read is retried until no
+ * stock change was in flight or started while it was read. After
+ * STOCK_READ_ATTEMPTS attempts new stock changes wait for the read, so it
+ * finishes even while changes keep coming. Returns the stock changes started
+ * before the read. The structure must be locked.
+ */
+static unsigned long readStock(Matamazom matamazom, int64_t *stock) {
+    unsigned long started = 0;
+    bool consistent = false;
+    int attempt;
+    for (attempt = 0; !consistent; attempt++) {
+        if (attempt == STOCK_READ_ATTEMPTS) {
+            __atomic_add_fetch(&matamazom->stock_readers_waited, 1,
+                               __ATOMIC_SEQ_CST);
+        }
+        // the changes finished are read first, so equal counts mean none was
+        // in flight when the changes started were read
+        unsigned long finished = __atomic_load_n(
+                &matamazom->stock_changes_finished, __ATOMIC_ACQUIRE);
+        started = __atomic_load_n(&matamazom->stock_changes_started,
+                                  __ATOMIC_ACQUIRE);
+        if (started != finished) {
+            sched_yield();
+            continue;
+        }
+        int position = 0;
+        ASIterator iterator;
+        AS_FOREACH_ITER(Product, product, iterator, matamazom->storage) {
+            // a change which wrote the stock read is then seen as started
+            stock[position++] = __atomic_load_n(&product->stock,
+                                                __ATOMIC_ACQUIRE);
+        }
+        consistent = __atomic_load_n(&matamazom->stock_changes_started,
+                                     __ATOMIC_RELAXED) == started;
+    }
+    if (attempt > STOCK_READ_ATTEMPTS) {
+        __atomic_sub_fetch(&matamazom->stock_readers_waited, 1,
+                           __ATOMIC_SEQ_CST);
+    }
+    return started;
+}
+
+/*
+ * Stock changes are counted as started before they write any stock, and as
+ * finished once all of it is written, so a reader of the stock finds out
+ * whether a change could have been half seen (@see readStock). The stock is
+ * written with release order, after the change is counted as started. Stock
+ * changes take no lock, and only wait while a reader asked them to.
+ */
+static void beginStockChange(Matamazom matamazom) {
+    while (__atomic_load_n(&matamazom->stock_readers_waited,
+                           __ATOMIC_SEQ_CST) > 0) {
+        sched_yield();
+    }
+    __atomic_add_fetch(&matamazom->stock_changes_started, 1, __ATOMIC_SEQ_CST);
+}
+
+static void endStockChange(Matamazom matamazom) {
+    __atomic_add_fetch(&matamazom->stock_changes_finished, 1,
+                       __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns a new reference to the latest snapshot if no product changed since
+ * it was taken, and NULL otherwise.
+ */
+static MatamazomSnapshot currentSnapshot(Matamazom matamazom) {
+    lockSnapshots(matamazom);
+    MatamazomSnapshot snapshot = matamazom->snapshot;
+    if (snapshot != NULL &&
+        (__atomic_load_n(&matamazom->stock_changes_finished,
+                         __ATOMIC_ACQUIRE) != snapshot->stock_version ||
+         __atomic_load_n(&matamazom->stock_changes_started,
+                         __ATOMIC_ACQUIRE) != snapshot->stock_version)) {
+        snapshot = NULL; // the stock changed, or is changing
+    }
+    for (int i = 0; snapshot != NULL && i < PRODUCT_LOCK_STRIPES; i++) {
+        if (__atomic_load_n(&matamazom->storage_epochs[i], __ATOMIC_ACQUIRE) !=
+            snapshot->segments[i]->epoch) {
+            snapshot = NULL;
+        }
+    }
+    if (snapshot != NULL) {
+        snapshot->references++;
+    }
+    unlockSnapshots(matamazom);
+    return snapshot;
+}
+
+/* Makes snapshot the latest one, which the Matamazom keeps a reference to */
+static void publishSnapshot(Matamazom matamazom, MatamazomSnapshot snapshot) {
+    lockSnapshots(matamazom);
+    MatamazomSnapshot previous = matamazom->snapshot;
+    matamazom->snapshot = snapshot;
+    snapshot->references++;
+    unlockSnapshots(matamazom);
+    mtmSnapshotRelease(previous);
+}
+
+/*
+ * Marks the products of stripes as added, removed or repriced since the
+ * snapshots taken before. Changes of stock are counted apart, as they take no
+ * lock (@see beginStockChange).
+ */
+static void touchStorage(Matamazom matamazom, ProductStripes stripes) {
+    for (int i = 0; i < PRODUCT_LOCK_STRIPES; i++) {
+        if (stripes & ((ProductStripes) 1 << i)) {
+            __atomic_add_fetch(&matamazom->storage_epochs[i], 1,
+                               __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/*
+ * A Matamazom created by matamazomCreateConcurrent has locks, any other has
+ * none and all the functions below do nothing for it.
+ *
+ * The structure lock is held exclusively while products are added or
+ * removed and while a price is invalidated, and shared by every other
+ * operation. Under the shared lock the storage, the product index and the
+ * products' names never change, so products are found without further
+ * locking.
+ *
+ * An operation on an order first takes the order over (@see lockOrder), so
+ * operations on different orders never wait for each other. The amounts in
+ * the storage, the stock of the products, the cached prices and the epochs
+ * are changed atomically, so changing stock, reserving and shipping take no
+ * lock of the products. A snapshot still reads the stock of all products as
+ * it was at a single moment, by retrying (@see readStock). Only a product's
+ * list of orders is guarded by the stripe of its id. The table of orders, the
+ * sales and the snapshots are only held for a short while and nothing else is
+ * locked under them.
+ */
 
+static bool initLocks(MatamazomLocks locks) {
+    if (pthread_rwlock_init(&locks->structure, NULL) != 0) {
+        return false;
+    }
+    locks->order_waiters = 0;
+    bool success = pthread_mutex_init(&locks->orders, NULL) == 0 &&
+                   pthread_cond_init(&locks->order_released, NULL) == 0 &&
+                   pthread_mutex_init(&locks->sales, NULL) == 0 &&
+                   pthread_mutex_init(&locks->snapshots, NULL) == 0;
+    for (int i = 0; success && i < PRODUCT_LOCK_STRIPES; i++) {
+        success = pthread_mutex_init(&locks->product_stripes[i], NULL) == 0;
+    }
+    return success;
+}
+
+static void destroyLocks(MatamazomLocks locks) {
+    pthread_rwlock_destroy(&locks->structure);
+    pthread_mutex_destroy(&locks->orders);
+    pthread_cond_destroy(&locks->order_released);
+    pthread_mutex_destroy(&locks->sales);
+    pthread_mutex_destroy(&locks->snapshots);
+    for (int i = 0; i < PRODUCT_LOCK_STRIPES; i++) {
+        pthread_mutex_destroy(&locks->product_stripes[i]);
+    }
+}
+
+static void lockStructure(Matamazom matamazom, bool exclusive) {
+    if (matamazom->locks == NULL) {
+        return;
+    }
+    if (exclusive) {
+        pthread_rwlock_wrlock(&matamazom->locks->structure);
+    } else {
+        pthread_rwlock_rdlock(&matamazom->locks->structure);
+    }
+}
+
+static void unlockStructure(Matamazom matamazom) {
+    if (matamazom->locks != NULL) {
+        pthread_rwlock_unlock(&matamazom->locks->structure);
+    }
+}
+
+/*
+ * Locks the structure shared and takes the order over, waiting while another
+ * thread owns it. Returns the order, or NULL if there is no such order. The
+ * owner may ship or cancel the order; unlockOrder then finds it gone.
+ */
+static Order lockOrder(Matamazom matamazom, unsigned int orderId) {
+    lockStructure(matamazom, false);
+    return ownOrder(matamazom, orderId);
+}
+
+static void unlockOrder(Matamazom matamazom, unsigned int orderId) {
+    disownOrder(matamazom, orderId);
+    unlockStructure(matamazom);
+}
+
+/*
+ * Takes an order over, waiting while another thread owns it, and returns it,
+ * or NULL if it doesn't exist. The structure must be locked.
+ */
+static Order ownOrder(Matamazom matamazom, unsigned int orderId) {
+    if (matamazom->locks == NULL) {
+        return findOrder(matamazom, orderId);
+    }
+    lockOrders(matamazom);
+    Order order = orderSlot(matamazom, orderId);
+    while (order != NULL && order->owned) {
+        matamazom->locks->order_waiters++;
+        pthread_cond_wait(&matamazom->locks->order_released,
+                          &matamazom->locks->orders);
+        matamazom->locks->order_waiters--;
+        order = orderSlot(matamazom, orderId);
+    }
+    if (order != NULL) {
+        order->owned = true;
+    }
+    unlockOrders(matamazom);
+    return order;
+}
+
+static void disownOrder(Matamazom matamazom, unsigned int orderId) {
+    if (matamazom->locks != NULL) {
+        lockOrders(matamazom);
+        Order order = orderSlot(matamazom, orderId);
+        if (order != NULL) {
+            order->owned = false;
+        }
+        if (matamazom->locks->order_waiters > 0) {
+            pthread_cond_broadcast(&matamazom->locks->order_released);
+        }
+        unlockOrders(matamazom);
+    }
+    unlockStructure(matamazom);
+}
+
+static int productStripeIndex(unsigned int id) {
+    return (int) (hashProductId(id) % PRODUCT_LOCK_STRIPES);
+}
+
+static ProductStripes productStripe(unsigned int id) {
+    return (ProductStripes) 1 << productStripeIndex(id);
+}
+
+/* Locks stripes in increasing order, and returns the stripes it locked */
+static ProductStripes lockProducts(Matamazom matamazom, ProductStripes stripes) {
+    if (matamazom->locks == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < PRODUCT_LOCK_STRIPES; i++) {
+        if (stripes & ((ProductStripes) 1 << i)) {
+            pthread_mutex_lock(&matamazom->locks->product_stripes[i]);
+        }
+    }
+    return stripes;
+}
+
+static void unlockProducts(Matamazom matamazom, ProductStripes stripes) {
+    if (matamazom->locks == NULL) {
+        return;
+    }
+    for (int i = 0; i < PRODUCT_LOCK_STRIPES; i++) {
+        if (stripes & ((ProductStripes) 1 << i)) {
+            pthread_mutex_unlock(&matamazom->locks->product_stripes[i]);
+        }
+    }
+}
+
+static void lockOrders(Matamazom matamazom) {
+    if (matamazom->locks != NULL) {
+        pthread_mutex_lock(&matamazom->locks->orders);
+    }
+}
+
+static void unlockOrders(Matamazom matamazom) {
+    if (matamazom->locks != NULL) {
+        pthread_mutex_unlock(&matamazom->locks->orders);
+    }
+}
+
+static void lockSales(Matamazom matamazom) {
+    if (matamazom->locks != NULL) {
+        pthread_mutex_lock(&matamazom->locks->sales);
+    }
+}
+
+static void unlockSales(Matamazom matamazom) {
+    if (matamazom->locks != NULL) {
+        pthread_mutex_unlock(&matamazom->locks->sales);
+    }
+}
+
+static void lockSnapshots(Matamazom matamazom) {
+    if (matamazom->locks != NULL) {
+        pthread_mutex_lock(&matamazom->locks->snapshots);
+    }
+}
+
+static void unlockSnapshots(Matamazom matamazom) {
+    if (matamazom->locks != NULL) {
+        pthread_mutex_unlock(&matamazom->locks->snapshots);
+    }
+}
@@ -27,6 +27,10 @@ typedef enum MatamazomResult_t {
  * 
  * For MATAMAZOM_ANY_AMOUNT, any amount is valid. For example, this is suitable for
  * products which are measured by weight.
+ *
+ * Amounts are kept to the nearest millionth, so for every amount type an amount
+ * is invalid if it is not 0 but rounds to 0, or if its absolute value is
+ * 9.2e12 or more.
  */
 typedef enum MatamazomAmountType_t {
     MATAMAZOM_INTEGER_AMOUNT,
@@ -37,6 +41,9 @@ typedef enum MatamazomAmountType_t {
 /** Type for representing a Matamazom warehouse */
 typedef struct Matamazom_t *Matamazom;
 
+/** Type for representing a consistent view of a Matamazom warehouse's inventory */
+typedef struct MatamazomSnapshot_t *MatamazomSnapshot;
+
 /** Type for additional custom data of a product */
 typedef void *MtmProductData;
 
@@ -107,6 +114,28 @@ typedef bool (*MtmFilterProduct)(const unsigned int id, const char *name, const
  */
 Matamazom matamazomCreate();
 
+/**
+ * matamazomCreateConcurrent: create an empty Matamazom warehouse which may be
+ * used by several threads at once.
+ *
+ * All functions may be called concurrently on such a warehouse, except
+ * matamazomDestroy. Calls on different products, such as
+ * mtmChangeProductAmount, and calls on different orders run in parallel.
+ * Editing different orders with mtmChangeProductAmountInOrder does not wait
+ * for other calls on the same products, except briefly when a product is
+ * added to or removed from an order, or when the order was reserved.
+ * Stock amounts are changed atomically, so changing the amount of a product,
+ * reserving and shipping orders never wait for each other, even on the same
+ * product. Adding or clearing a product and invalidating a price wait for
+ * all other calls to finish. mtmPrintInventory and mtmPrintFiltered print
+ * from a snapshot (@see mtmSnapshotAcquire), so other calls go on while they
+ * print.
+ *
+ * @return A new Matamazom warehouse in case of success, and NULL otherwise (e.g.
+ *     in case of an allocation error)
+ */
+Matamazom matamazomCreateConcurrent();
+
 /**
  * matamazomDestroy: free a Matamazom warehouse, and all its contents, from
  * memory.
@@ -144,6 +173,47 @@ MatamazomResult mtmNewProduct(Matamazom matamazom, const unsigned int id, const
                               const double amount, const MatamazomAmountType amountType,
                               const MtmProductData customData, MtmCopyData copyData,
                               MtmFreeData freeData, MtmGetProductPrice prodPrice);
+
+/**
+ * mtmNewProductWithPricing: add a new product to a Matamazom warehouse,
+ * declaring whether its price is linear in the amount.
+ *
+ * Works like mtmNewProduct. The price of one unit of every product is cached
+ * on the first time it is needed, and prodPrice is not called again for it
+ * until mtmInvalidatePrice is called. If linearPricing is true, prodPrice
+ * must return the price of one unit times the amount, and the price of any
+ * amount is computed from the cached unit price without calling prodPrice.
+ * mtmNewProduct adds a product whose pricing is not linear.
+ *
+ * @param linearPricing - whether prodPrice is linear in the amount.
+ * @return
+ *     The same as mtmNewProduct.
+ */
+MatamazomResult mtmNewProductWithPricing(Matamazom matamazom, const unsigned int id,
+                                         const char *name, const double amount,
+                                         const MatamazomAmountType amountType,
+                                         const MtmProductData customData,
+                                         MtmCopyData copyData, MtmFreeData freeData,
+                                         MtmGetProductPrice prodPrice,
+                                         bool linearPricing);
+
+/**
+ * mtmInvalidatePrice: drop the cached price of a product in a Matamazom
+ * warehouse, so it is computed again by its prodPrice function.
+ *
+ * Must be called whenever the result prodPrice would return for the product
+ * changes, e.g. after the product's price table was updated.
+ *
+ * @param matamazom - a Matamazom warehouse.
+ * @param id - existing product id.
+ * @return
+ *     MATAMAZOM_NULL_ARGUMENT - if a NULL argument is passed.
+ *     MATAMAZOM_PRODUCT_NOT_EXIST - if matamazom does not contain a product with
+ *         the given id.
+ *     MATAMAZOM_SUCCESS - if the cached price was dropped.
+ */
+MatamazomResult mtmInvalidatePrice(Matamazom matamazom, const unsigned int id);
+
 /**
  * mtmChangeProductAmount: increase or decrease the amount of an *existing* product in a Matamazom warehouse.
  * if 'amount' < 0 then this amount should be decreased from the matamazom warehouse.
@@ -156,6 +226,8 @@ MatamazomResult mtmNewProduct(Matamazom matamazom, const unsigned int id, const
  * If the amount is equal to the product's amount in the
  * warehouse,then the product will remain inside the warehouse 
  * with amount of zero.
+ * The amount can't be decreased below the amount reserved by orders
+ * (@see mtmReserveOrder).
  *
  * @param matamazom - warehouse to add the product to. Must be non-NULL.
  * @param id - existing product id. Must exist in the warehouse.
@@ -257,11 +329,62 @@ MatamazomResult mtmChangeProductAmountInOrder(Matamazom, const unsigned int orde
  *     MATAMAZOM_ORDER_NOT_EXIST - if matamazom does not contain an order with
  *         the given orderId.
  *     MATAMAZOM_INSUFFICIENT_AMOUNT - if the order contains a product with an amount
- *         that is larger than its amount in matamazom.
+ *         that is larger than its amount in matamazom, not counting amounts
+ *         reserved by other orders (@see mtmReserveOrder). A reserved order
+ *         never fails for this reason.
  *     MATAMAZOM_SUCCESS - if the order was shipped successfully.
  */
 MatamazomResult mtmShipOrder(Matamazom matamazom, const unsigned int orderId);
 
+/**
+ * mtmShipOrders: ship many orders of a Matamazom warehouse, with the same
+ * results as calling mtmShipOrder on each of them in the given order.
+ *
+ * On a warehouse created by matamazomCreateConcurrent, orders which have no
+ * product in common are shipped in parallel by several threads, and only
+ * orders with common products are shipped one after the other, in the given
+ * order. Other calls on the warehouse go on meanwhile, except calls on the
+ * orders of the batch, which wait until the batch is shipped, and calls which
+ * add or clear a product or invalidate a price.
+ *
+ * @param matamazom - warehouse containing the orders and all the products.
+ * @param orderIds - array of n ids of the orders to ship. An id may repeat.
+ * @param n - the number of orders to ship.
+ * @param results - array of n results, results[i] is set to the result of
+ *     shipping orderIds[i] (@see mtmShipOrder).
+ * @return
+ *     MATAMAZOM_NULL_ARGUMENT - if a NULL argument is passed.
+ *     MATAMAZOM_OUT_OF_MEMORY - if an allocation failed. No order was shipped.
+ *     MATAMAZOM_SUCCESS - if every order was shipped or failed to ship, as
+ *         set in results.
+ */
+MatamazomResult mtmShipOrders(Matamazom matamazom, const unsigned int *orderIds,
+                              int n, MatamazomResult *results);
+
+/**
+ * mtmReserveOrder: reserve the amounts of all products of an order in a
+ * Matamazom warehouse.
+ *
+ * The reserved amounts stay in the warehouse but can't be used by other
+ * orders or removed by mtmChangeProductAmount, so a reserved order can always
+ * be shipped. Either the amounts of all products of the order are reserved
+ * or none is. The reservation ends when the order is shipped or cancelled,
+ * or when the amount of any product in the order is changed. Reserving an
+ * order which is already reserved does nothing.
+ *
+ * @param matamazom - a Matamazom warehouse.
+ * @param orderId - id of the order to reserve.
+ * @return
+ *     MATAMAZOM_NULL_ARGUMENT - if a NULL argument is passed.
+ *     MATAMAZOM_ORDER_NOT_EXIST - if matamazom does not contain an order with
+ *         the given orderId.
+ *     MATAMAZOM_INSUFFICIENT_AMOUNT - if the warehouse does not have enough of
+ *         some product in the order, beyond the amounts reserved by other
+ *         orders.
+ *     MATAMAZOM_SUCCESS - if the order was reserved.
+ */
+MatamazomResult mtmReserveOrder(Matamazom matamazom, const unsigned int orderId);
+
 /**
  * mtmCancelOrder: cancel an order and remove it from a Matamazom warehouse.
  *
@@ -286,6 +409,8 @@ MatamazomResult mtmCancelOrder(Matamazom matamazom, const unsigned int orderId);
  * @param output - an open, writable output stream, to which the contents are printed.
  * @return
  *     MATAMAZOM_NULL_ARGUMENT - if a NULL argument is passed.
+ *     MATAMAZOM_OUT_OF_MEMORY - if matamazom was created by
+ *         matamazomCreateConcurrent and its snapshot could not be taken.
  *     MATAMAZOM_SUCCESS - if printed successfully.
  */
 MatamazomResult mtmPrintInventory(Matamazom matamazom, FILE *output);
@@ -307,6 +432,25 @@ MatamazomResult mtmPrintInventory(Matamazom matamazom, FILE *output);
  */
 MatamazomResult mtmPrintOrder(Matamazom matamazom, const unsigned int orderId, FILE *output);
 
+/**
+ * mtmGetOrderTotal: get the total price of an order in a Matamazom warehouse,
+ * as printed in the order's summary.
+ *
+ * The total is kept up to date as the order is edited, so getting it does
+ * not go over the order's lines.
+ *
+ * @param matamazom - the Matamazom warehouse containing the order.
+ * @param orderId - id of the order in matamazom.
+ * @param outTotal - pointer to the location where the total is returned.
+ * @return
+ *     MATAMAZOM_NULL_ARGUMENT - if a NULL argument is passed.
+ *     MATAMAZOM_ORDER_NOT_EXIST - if matamazom does not contain an order with
+ *         the given orderId.
+ *     MATAMAZOM_SUCCESS - if the total was returned.
+ */
+MatamazomResult mtmGetOrderTotal(Matamazom matamazom, const unsigned int orderId,
+                                 double *outTotal);
+
 /**
  * mtmPrintBestSelling: print the best selling products of a Matamazom
  * warehouse, as explained in the *.pdf.
@@ -319,6 +463,26 @@ MatamazomResult mtmPrintOrder(Matamazom matamazom, const unsigned int orderId, F
  */
 MatamazomResult mtmPrintBestSelling(Matamazom matamazom, FILE *output);
 
+/**
+ * mtmGetTopSellers: get the ids of the best selling products of a Matamazom
+ * warehouse.
+ *
+ * Products are ordered by their income from shipped orders, from high to low,
+ * and by id on equal income. Products with no income are not listed. The
+ * order is kept up to date as orders are shipped, so this does not go over
+ * the whole warehouse.
+ *
+ * @param matamazom - a Matamazom warehouse.
+ * @param k - the number of products to get.
+ * @param out - an array of at least k ids, filled with the ids of the best
+ *     selling products, the best seller first.
+ * @return
+ *     -1 if a NULL argument is passed, k is negative or an allocation failed.
+ *     Otherwise the number of ids written to out, which is k unless fewer
+ *     products have any income.
+ */
+int mtmGetTopSellers(Matamazom matamazom, int k, unsigned int *out);
+
 /**
  * mtmPrintFiltered: print some products of a Matamazom warehouse, according to
  * a custom filter, as explained in the *.pdf.
@@ -333,8 +497,70 @@ MatamazomResult mtmPrintBestSelling(Matamazom matamazom, FILE *output);
  * @param output - an open, writable output stream, to which the order is printed.
  * @return
  *     MATAMAZOM_NULL_ARGUMENT - if a NULL argument is passed.
+ *     MATAMAZOM_OUT_OF_MEMORY - if matamazom was created by
+ *         matamazomCreateConcurrent and its snapshot could not be taken.
  *     MATAMAZOM_SUCCESS - if printed successfully.
  */
 MatamazomResult mtmPrintFiltered(Matamazom matamazom, MtmFilterProduct customFilter, FILE *output);
 
+/**
+ * mtmSnapshotAcquire: get a snapshot of the inventory of a Matamazom warehouse.
+ *
+ * A snapshot holds the products of the warehouse with their amounts and
+ * prices at the time it is acquired, and is never changed afterwards.
+ * Reading a snapshot takes no lock of the warehouse, so on a warehouse
+ * created by matamazomCreateConcurrent other calls go on while it is read.
+ * While the inventory does not change, every call returns the same snapshot
+ * without copying the inventory again; otherwise only the products of the
+ * parts of the inventory which changed are copied again. On such a warehouse
+ * other calls go on while the snapshot is taken, and the snapshot still
+ * shows every product as it was at a single moment: an order shipped
+ * meanwhile shows in all of its products or in none. Changes of amounts may
+ * wait briefly while the amounts are read.
+ *
+ * Every snapshot must be released with mtmSnapshotRelease before the
+ * warehouse is destroyed.
+ *
+ * @param matamazom - a Matamazom warehouse.
+ * @return A snapshot in case of success, and NULL if a NULL argument is passed
+ *     or an allocation failed.
+ */
+MatamazomSnapshot mtmSnapshotAcquire(Matamazom matamazom);
+
+/**
+ * mtmSnapshotRelease: release a snapshot acquired by mtmSnapshotAcquire.
+ *
+ * @param snapshot - the snapshot to release. A NULL value is allowed, and in
+ *     that case the function does nothing.
+ */
+void mtmSnapshotRelease(MatamazomSnapshot snapshot);
+
+/**
+ * mtmSnapshotPrintInventory: print the inventory of a snapshot, like
+ * mtmPrintInventory.
+ *
+ * @param snapshot - a snapshot of a Matamazom warehouse.
+ * @param output - an open, writable output stream, to which the contents are printed.
+ * @return
+ *     MATAMAZOM_NULL_ARGUMENT - if a NULL argument is passed.
+ *     MATAMAZOM_SUCCESS - if printed successfully.
+ */
+MatamazomResult mtmSnapshotPrintInventory(MatamazomSnapshot snapshot, FILE *output);
+
+/**
+ * mtmSnapshotPrintFiltered: print some products of a snapshot, according to a
+ * custom filter, like mtmPrintFiltered.
+ *
+ * @param snapshot - a snapshot of a Matamazom warehouse.
+ * @param customFilter - a boolean function that receives a product's information and
+ *     returns true if it should be printed.
+ * @param output - an open, writable output stream, to which the products are printed.
+ * @return
+ *     MATAMAZOM_NULL_ARGUMENT - if a NULL argument is passed.
+ *     MATAMAZOM_SUCCESS - if printed successfully.
+ */
+MatamazomResult mtmSnapshotPrintFiltered(MatamazomSnapshot snapshot,
+                                         MtmFilterProduct customFilter,
+                                         FILE *output);
+
 #endif /* MATAMAZOM_H_ */